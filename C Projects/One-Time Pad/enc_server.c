@@ -7,38 +7,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-
-
-/* Encrypts the plaintext with the keytext and puts it in enc_text. */
-void encrypt(char *enc_text, char *plaintext, char *keytext) {
-  // Int variables used to do the appropriate conversions.
-  int temp1, temp2, temp3;
-  for(int i = 0; i < strlen(plaintext); i++) {
-    // Decrements the chars' dec values to be 0 = 'A'.... 25 = 'Z' and 26 = SPACE.
-    temp1 = plaintext[i] - 65;
-    temp2 = keytext[i] - 65;
-    // Gives each SPACE char the temporary dec value of 26.
-    if (plaintext[i] == 32) {
-        temp1 = 26;
-    }
-
-    if (keytext[i] == 32) {
-        temp2 = 26;
-    }
-
-    // Temp intermediate of summing the chars.
-    temp3 = ((temp1 + temp2) % 27);
-    
-    // If temp3 is 26, change value to 32 = SPACE.
-    if (temp3 == 26) {
-        enc_text[i] = 32;
-    }
-    // Otherwise the value is temp3 + 65. 
-    else {
-        enc_text[i] = (temp3 + 65);
-    }
-  }
-}
+#include "otp.h"        // encrypt(), decrypt()
 
 
 /* Set up the address struct for the server socket. */
@@ -82,8 +51,9 @@ int main(int argc, char *argv[]){
     exit(1);
   }
 
-  // Start listening for connetions. Allow up to 5 connections to queue up.
-  listen(listenSocket, 5); 
+  // Start listening for connetions. Allow up to 128 connections to queue up so a client
+  // sending shards over many connections at once isn't left waiting on a full backlog.
+  listen(listenSocket, 128); 
   
   // Accept a connection, blocking if one is not available until one connects.
   while(1) {
@@ -105,12 +75,12 @@ int main(int argc, char *argv[]){
             break;
         // Proceed to launch the child program as normal.
         case 0: {
-            char cs_check[4], buffsize[10];
+            char cs_check[4], buffsize[11];
             char authenticate[5] = "fals";
             int client_check, input_size;
     
             // Receives the the identifer from the client (either enc or dec).
-            int server_check = recv(connectFD, cs_check, 5, 0);
+            int server_check = recv(connectFD, cs_check, sizeof(cs_check), MSG_WAITALL);
             if (server_check < 0) {
                 fprintf(stderr, "SERVER: ERROR with client check\n");
             }
@@ -128,7 +98,7 @@ int main(int argc, char *argv[]){
                     fprintf(stderr, "SERVER: ERROR writing to socket\n");
                 }
                 close(connectFD);
-                break;
+                exit(0);
             }
 
             // Sends back the authentication from the server to the client.
@@ -137,53 +107,69 @@ int main(int argc, char *argv[]){
             fprintf(stderr, "SERVER: ERROR writing to socket\n");
             }
 
-            // Clear out the buffer for use.
-            memset(buffsize,'\0', sizeof(buffsize));
-            // Get the length of the incoming input from the client.
-            chars_read = recv(connectFD, buffsize, sizeof(buffsize), 0);
-            if (chars_read < 0) {
-                fprintf(stderr, "SERVER: ERROR receiving size of input from client\n");
-            }
-
-            // Covert the received input size into a number from a string.
-            input_size = atoi(buffsize);
-
-            // Prepare plaintext and keytext buffers to hold the incoming data.
-            char plaintext[input_size+1];
-            memset(plaintext, '\0', sizeof(plaintext));
-            char keytext[input_size+1];
-            memset(keytext, '\0', sizeof(keytext));
-            // Prepare encrypt text to hold plaint text after encryption.
-            char encrypt_text[input_size+1];
-            memset(encrypt_text, '\0', sizeof(encrypt_text));
-
-            // Receive the incoming plaintext data from client.
-            chars_read = recv(connectFD, plaintext, sizeof(plaintext)-1, MSG_WAITALL);
-            if (chars_read < 0) {
-              fprintf(stderr, "SERVER: ERROR receiving plaintext from client\n");
-            }
+            // Handles requests on this connection until the client closes it, so a client
+            // holding on to a connection only pays for the connect and handshake once.
+            while (1) {
+              // Clear out the buffer for use.
+              memset(buffsize,'\0', sizeof(buffsize));
+              // Get the length of the incoming input from the client, a fixed 10 byte field.
+              chars_read = recv(connectFD, buffsize, 10, MSG_WAITALL);
+              if (chars_read < 0) {
+                  fprintf(stderr, "SERVER: ERROR receiving size of input from client\n");
+              }
+              // The client closed the connection, it has no more requests.
+              if (chars_read < 10) {
+                  break;
+              }
 
-            // Receive the incoming keytext data from client.
-            chars_read = recv(connectFD, keytext, sizeof(keytext)-1, MSG_WAITALL);
-            if (chars_read < 0) {
-              fprintf(stderr, "SERVER: ERROR receiving keytext from client\n");
-            }
-            
-            // Encrypts the plaintext and puts the results in encrypt_text.
-            encrypt(encrypt_text, plaintext, keytext);
-
-            // Sends back the now encrypted plaintext to the client. 
-            chars_written = 0;
-            len = 0;
-            while (chars_written < input_size) {
-              len = send(connectFD, encrypt_text, strlen(encrypt_text), 0);
-              if (len < 0) {
-                fprintf(stderr, "SERVER: ERROR sending ciphertext to client.\n");
+              // Covert the received input size into a number from a string.
+              input_size = atoi(buffsize);
+
+              // Prepare plaintext and keytext buffers to hold the incoming data. These are on the
+              // heap since large inputs would overflow the stack.
+              char *plaintext = calloc(input_size+1, 1);
+              char *keytext = calloc(input_size+1, 1);
+              // Prepare encrypt text to hold plaint text after encryption.
+              char *encrypt_text = calloc(input_size+1, 1);
+              if (plaintext == NULL || keytext == NULL || encrypt_text == NULL) {
+                fprintf(stderr, "SERVER: ERROR allocating buffers for input\n");
                 exit(1);
               }
-              chars_written += len;
+
+              // Receive the incoming plaintext data from client.
+              chars_read = recv(connectFD, plaintext, input_size, MSG_WAITALL);
+              if (chars_read < 0) {
+                fprintf(stderr, "SERVER: ERROR receiving plaintext from client\n");
+              }
+
+              // Receive the incoming keytext data from client.
+              chars_read = recv(connectFD, keytext, input_size, MSG_WAITALL);
+              if (chars_read < 0) {
+                fprintf(stderr, "SERVER: ERROR receiving keytext from client\n");
+              }
+            
+              // Encrypts the plaintext and puts the results in encrypt_text.
+              encrypt(encrypt_text, plaintext, keytext, input_size);
+
+              // Sends back the now encrypted plaintext to the client. 
+              chars_written = 0;
               len = 0;
+              while (chars_written < input_size) {
+                len = send(connectFD, encrypt_text + chars_written, input_size - chars_written, 0);
+                if (len < 0) {
+                  fprintf(stderr, "SERVER: ERROR sending ciphertext to client.\n");
+                  exit(1);
+                }
+                chars_written += len;
+                len = 0;
+              }
+
+              // Free the buffers before the next request.
+              free(plaintext);
+              free(keytext);
+              free(encrypt_text);
             }
+
             exit(0);
             break;
            }
@@ -1,47 +1,256 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "otp.h"        // chacha_seed(), generate_key()
+#include "otp_client.h" // endpoint_connect(), recv_all()
 
 
+// The key is generated and written this many chars at a time, so memory use doesn't grow with
+// the key length.
+#define KEY_BLOCK 65536
+
+
+/* The part of the output file one thread fills in. */
+struct range {
+    int fd;
+    long long start, len;
+    // Set by the thread if it couldn't seed its generator or write its part.
+    int error;
+};
+
+
+/* Writes all len bytes of buffer to fd at offset, or at the current position when offset is -1,
+   picking up where a partial write left off. */
+int write_all(int fd, const char *buffer, long len, long long offset) {
+    long written = 0;
+    while (written < len) {
+        ssize_t n;
+        if (offset < 0) {
+            n = write(fd, buffer + written, len - written);
+        } else {
+            n = pwrite(fd, buffer + written, len - written, offset + written);
+        }
+        if (n < 0) {
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+
+/* Generates len random chars and writes them to fd a block at a time, starting at offset (-1
+   for the current position). Every call seeds its own generator, so when threads each fill a
+   range their streams are independent of each other. Returns 0 or -1. */
+int generate_range(int fd, long long len, long long offset) {
+
+    // Seeds the generator from the kernel, so no two keys come out the same.
+    struct chacha generator;
+    if (chacha_seed(&generator) < 0) {
+        perror("keygen: getrandom()");
+        return -1;
+    }
+
+    // Holds one block of random chars at a time.
+    char *key = malloc(KEY_BLOCK);
+    if (key == NULL) {
+        perror("keygen: malloc()");
+        return -1;
+    }
+
+    while (len > 0) {
+        long block = len < KEY_BLOCK ? len : KEY_BLOCK;
+
+        // Gets a block of random chars A - Z and SPACE.
+        generate_key(&generator, key, block);
+        if (write_all(fd, key, block, offset) < 0) {
+            perror("keygen: write()");
+            free(key);
+            return -1;
+        }
+
+        len -= block;
+        if (offset >= 0) {
+            offset += block;
+        }
+    }
+
+    free(key);
+    return 0;
+}
+
+
+/* Takes len chars from an otp_pool listening on path instead of generating them, and writes
+   them to fd. The pool ID and offset of the segment are reported on stderr. Returns 0 or -1. */
+int fetch_from_pool(const char *path, int fd, long long len) {
+    struct endpoint pool;
+    if (endpoint_setup(&pool, path) < 0) {
+        return -1;
+    }
+    int socketFD = endpoint_connect(&pool);
+    if (socketFD < 0) {
+        return -1;
+    }
+
+    // Asks for len chars, the pool answers with a 64 byte header then the chars.
+    char length[20], header[64];
+    memset(length, '\0', sizeof(length));
+    snprintf(length, sizeof(length), "%019lld", len);
+    if (send_all(socketFD, length, sizeof(length), 0) < 0 || recv_all(socketFD, header, sizeof(header)) < 0) {
+        fprintf(stderr, "keygen: ERROR talking to the pool\n");
+        close(socketFD);
+        return -1;
+    }
+    header[sizeof(header) - 1] = '\0';
+    fprintf(stderr, "keygen: pool %.16s offset %lld length %lld\n", header, atoll(header + 17), len);
+
+    char *key = malloc(KEY_BLOCK);
+    if (key == NULL) {
+        perror("keygen: malloc()");
+        close(socketFD);
+        return -1;
+    }
+    while (len > 0) {
+        long block = len < KEY_BLOCK ? len : KEY_BLOCK;
+        if (recv_all(socketFD, key, block) < 0) {
+            fprintf(stderr, "keygen: ERROR receiving key from the pool\n");
+            break;
+        }
+        if (write_all(fd, key, block, -1) < 0) {
+            perror("keygen: write()");
+            break;
+        }
+        len -= block;
+    }
+
+    free(key);
+    close(socketFD);
+    return len == 0 ? 0 : -1;
+}
+
+
+/* Thread body, fills one range of the output file. */
+void* generate_thread(void *arg) {
+    struct range *r = arg;
+    r->error = generate_range(r->fd, r->len, r->start);
+    return NULL;
+}
 
 
 int main(int argc, char *argv[]) {
 
+    // -o writes the key to a file, -j splits the work for that file across threads and -p
+    // takes the key from an otp_pool instead of generating it.
+    char *output = NULL, *pool = NULL;
+    int threads = 1, opt;
+    while ((opt = getopt(argc, argv, "o:j:p:")) != -1) {
+        switch (opt) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'p':
+                pool = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "USAGE: %s [-o file] [-j threads] [-p pool_socket] keylength\n", argv[0]);
+                exit(1);
+        }
+    }
+
     // Checks to see if the appropriate number of files were passed.
-    if (argc < 2) {
+    if (optind >= argc) {
         printf("Not enough arguments, try ./keygen keylength\n");
         exit(0); 
     }
 
-    // Generates a seed to get a random number each time.
-    srand(time(0));
+    // Converts the argument into a number, keys can be longer than an int can hold.
+    char *end;
+    long long len = strtoll(argv[optind], &end, 10);
+    if (*end != '\0' || len < 0) {
+        fprintf(stderr, "Bad key length, try ./keygen keylength\n");
+        exit(1);
+    }
+
+    int fd = STDOUT_FILENO, result;
+    if (output != NULL) {
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("keygen: open()");
+            exit(1);
+        }
+    }
 
-    // Converts the argument into a int data type.
-    int len = atoi(argv[1]);
-    // Create a string to hold the random chars with the size being the argument + 1 to hold '\n'.
-    char key[len+1];
+    // Without -o, or when the key comes from a pool, the key streams out in order.
+    if (output == NULL || pool != NULL) {
+        if (pool != NULL) {
+            result = fetch_from_pool(pool, fd, len);
+        } else {
+            result = generate_range(fd, len, -1);
+        }
+        if (result < 0) {
+            exit(1);
+        }
+        // Sets the last spot to be a newline char.
+        if (write_all(fd, "\n", 1, -1) < 0) {
+            perror("keygen: write()");
+            exit(1);
+        }
+        return 0;
+    }
 
-    for (int i = 0; i < len; i++) {
-        // Gets a random number 0-27.
-        int tempNum = rand() % 27;
+    // Reserves the whole file up front so the threads' writes don't have to grow it. Some file
+    // systems can't preallocate, setting the size is enough for them.
+    result = posix_fallocate(fd, 0, len + 1);
+    if (result == EOPNOTSUPP || result == EINVAL) {
+        result = ftruncate(fd, len + 1) < 0 ? errno : 0;
+    }
+    if (result != 0) {
+        fprintf(stderr, "keygen: can't allocate %s: %s\n", output, strerror(result));
+        exit(1);
+    }
 
-        // Checks to see if the number is a ASCII number A - Z.
-        if (tempNum < 26) {
-            // 65 Represents 'A', so if tempNum is 0, then we have 65 + 0 = 65 = 'A' as an example.
-            key[i] = tempNum + 65;
+    // Every thread gets at least one block to fill.
+    if (threads > len / KEY_BLOCK) {
+        threads = len / KEY_BLOCK;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
 
-        // If the tempNum is 27, then we set the char to be the ASCII number 32 which is a SPACE.
-        } else {
-            key[i] = 32;
+    struct range ranges[threads];
+    pthread_t ids[threads];
+    // Ranges are whole blocks, the last one picks up the remainder.
+    long long chunk = (len / threads) / KEY_BLOCK * KEY_BLOCK;
 
+    for (int i = 0; i < threads; i++) {
+        ranges[i].fd = fd;
+        ranges[i].start = i * chunk;
+        ranges[i].len = (i == threads - 1) ? len - ranges[i].start : chunk;
+        if (pthread_create(&ids[i], NULL, generate_thread, &ranges[i]) != 0) {
+            fprintf(stderr, "keygen: ERROR creating thread\n");
+            exit(1);
         }
     }
 
+    int error = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        error |= ranges[i].error;
+    }
+
     // Sets the last spot to be a newline char.
-    key[len] = '\n';
-    write(STDOUT_FILENO, key, len+1);
+    if (error || write_all(fd, "\n", 1, len) < 0) {
+        fprintf(stderr, "keygen: ERROR writing %s\n", output);
+        exit(1);
+    }
 
+    close(fd);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,263 @@
+/* The one-time pad routines shared by the servers, keygen and otp_file. Text and keys only hold
+   the chars A-Z and SPACE, which are treated as the numbers 0-25 and 26. */
+#ifndef OTP_H
+#define OTP_H
+
+#include <string.h>
+#include <stdint.h>
+#include <sys/random.h> // getrandom()
+
+
+// Random bytes at or above this are thrown away. 243 = 9 * 27, so the bytes that are kept map
+// evenly onto the 27 key chars where a plain % 27 would favor the first few.
+#define KEY_REJECT 243
+
+
+/* Encrypts len chars of the plaintext with the keytext and puts them in enc_text. */
+void encrypt(char *enc_text, const char *plaintext, const char *keytext, long len) {
+  // Int variables used to do the appropriate conversions.
+  int temp1, temp2, temp3;
+  for(long i = 0; i < len; i++) {
+    // Decrements the chars' dec values to be 0 = 'A'.... 25 = 'Z' and 26 = SPACE.
+    temp1 = plaintext[i] - 65;
+    temp2 = keytext[i] - 65;
+    // Gives each SPACE char the temporary dec value of 26.
+    if (plaintext[i] == 32) {
+        temp1 = 26;
+    }
+
+    if (keytext[i] == 32) {
+        temp2 = 26;
+    }
+
+    // Temp intermediate of summing the chars.
+    temp3 = ((temp1 + temp2) % 27);
+    
+    // If temp3 is 26, change value to 32 = SPACE.
+    if (temp3 == 26) {
+        enc_text[i] = 32;
+    }
+    // Otherwise the value is temp3 + 65. 
+    else {
+        enc_text[i] = (temp3 + 65);
+    }
+  }
+}
+
+
+/* Decrypts len chars of the ciphertext with the keytext and puts them in dec_text. */
+void decrypt(char *dec_text, const char *ciphertext, const char *keytext, long len) {
+  // Int variables used to do the appropriate conversions.
+  int temp1, temp2, temp3;
+  for(long i = 0; i < len; i++) {
+    // Decrements the chars' dec values to be 0 = 'A'.... 25 = 'Z' and 26 = SPACE.
+    temp1 = ciphertext[i] - 65;
+    temp2 = keytext[i] - 65;
+    // Gives each SPACE char the temporary dec value of 26.
+    if (ciphertext[i] == 32) {
+        temp1 = 26;
+    }
+
+    if (keytext[i] == 32) {
+        temp2 = 26;
+    }
+
+    // Temp intermediate of finding the difference between the chars and getting the MOD 27 value.
+    temp3 = ((temp1 - temp2 + 27) % 27);
+    
+    // If temp3 is 26, change value to 32 = SPACE.
+    if (temp3 == 26) {
+        dec_text[i] = 32;
+    }
+    // Otherwise the value is temp3 + 65. 
+    else {
+        dec_text[i] = (temp3 + 65);
+    }
+  }
+}
+
+
+// 16 chars handled at once by encrypt_wide() and decrypt_wide(), using GCC's vector extensions so
+// the same code becomes SSE2 on x86 and NEON on ARM.
+typedef unsigned char otp_vector __attribute__((vector_size(16)));
+
+/* Same result as encrypt(), 16 chars at a time without branches. otp_microbench checks the two match. */
+void encrypt_wide(char *enc_text, const char *plaintext, const char *keytext, long len) {
+  long i = 0;
+  for (; i + 16 <= len; i += 16) {
+    otp_vector p, k;
+    memcpy(&p, plaintext + i, 16);
+    memcpy(&k, keytext + i, 16);
+
+    // A comparison gives all ones in the chars where it's true, used as a mask to pick between
+    // two results. 0 = 'A'.... 25 = 'Z' and 26 = SPACE.
+    otp_vector space = (otp_vector) (p == 32);
+    otp_vector a = ((p - 65) & ~space) | (26 & space);
+    space = (otp_vector) (k == 32);
+    otp_vector b = ((k - 65) & ~space) | (26 & space);
+
+    // The sum is at most 52, so taking 27 off once is the MOD 27.
+    otp_vector sum = a + b;
+    sum -= 27 & (otp_vector) (sum >= 27);
+
+    // 26 becomes SPACE, everything else is + 65.
+    space = (otp_vector) (sum == 26);
+    otp_vector out = ((sum + 65) & ~space) | (32 & space);
+    memcpy(enc_text + i, &out, 16);
+  }
+
+  // The chars left over after the last full 16.
+  encrypt(enc_text + i, plaintext + i, keytext + i, len - i);
+}
+
+
+/* Same result as decrypt(), 16 chars at a time like encrypt_wide(). */
+void decrypt_wide(char *dec_text, const char *ciphertext, const char *keytext, long len) {
+  long i = 0;
+  for (; i + 16 <= len; i += 16) {
+    otp_vector c, k;
+    memcpy(&c, ciphertext + i, 16);
+    memcpy(&k, keytext + i, 16);
+
+    otp_vector space = (otp_vector) (c == 32);
+    otp_vector a = ((c - 65) & ~space) | (26 & space);
+    space = (otp_vector) (k == 32);
+    otp_vector b = ((k - 65) & ~space) | (26 & space);
+
+    // Adding 27 first keeps the difference from going below 0.
+    otp_vector diff = a + 27 - b;
+    diff -= 27 & (otp_vector) (diff >= 27);
+
+    space = (otp_vector) (diff == 26);
+    otp_vector out = ((diff + 65) & ~space) | (32 & space);
+    memcpy(dec_text + i, &out, 16);
+  }
+
+  decrypt(dec_text + i, ciphertext + i, keytext + i, len - i);
+}
+
+
+/* A ChaCha20 keystream used as the random number generator for keys. Each generator is seeded
+   with its own key and nonce from getrandom(), so separate generators give independent streams. */
+struct chacha {
+  uint32_t state[16];
+};
+
+
+/* Seeds a generator from the kernel. Returns 0, or -1 if getrandom() fails. */
+int chacha_seed(struct chacha *c) {
+  // "expand 32-byte k"
+  c->state[0] = 0x61707865;
+  c->state[1] = 0x3320646e;
+  c->state[2] = 0x79622d32;
+  c->state[3] = 0x6b206574;
+
+  // 8 words of key, then 2 words of block counter starting at 0 and 2 words of nonce. The 64 bit
+  // counter lets one stream run far past the size of any pad.
+  uint32_t seed[10];
+  if (getrandom(seed, sizeof(seed), 0) != sizeof(seed)) {
+    return -1;
+  }
+  memcpy(&c->state[4], seed, 8 * sizeof(uint32_t));
+  c->state[12] = 0;
+  c->state[13] = 0;
+  c->state[14] = seed[8];
+  c->state[15] = seed[9];
+  return 0;
+}
+
+
+// Blocks worked on side by side. Each step of the rounds is a loop over the lanes, which the
+// compiler turns into vector instructions, so 8 blocks cost little more than 1.
+#define CHACHA_LANES 8
+#define CHACHA_ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/* One ChaCha quarter round, run on every lane. */
+static inline void chacha_quarter(uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+  for (int l = 0; l < CHACHA_LANES; l++) { a[l] += b[l]; d[l] ^= a[l]; d[l] = CHACHA_ROTATE(d[l], 16); }
+  for (int l = 0; l < CHACHA_LANES; l++) { c[l] += d[l]; b[l] ^= c[l]; b[l] = CHACHA_ROTATE(b[l], 12); }
+  for (int l = 0; l < CHACHA_LANES; l++) { a[l] += b[l]; d[l] ^= a[l]; d[l] = CHACHA_ROTATE(d[l], 8); }
+  for (int l = 0; l < CHACHA_LANES; l++) { c[l] += d[l]; b[l] ^= c[l]; b[l] = CHACHA_ROTATE(b[l], 7); }
+}
+
+
+/* Puts the next CHACHA_LANES blocks of 64 bytes of the keystream in out. */
+void chacha_blocks(struct chacha *c, unsigned char out[CHACHA_LANES * 64]) {
+  uint32_t x[16][CHACHA_LANES], start[16][CHACHA_LANES];
+  uint64_t counter = ((uint64_t) c->state[13] << 32) | c->state[12];
+
+  // Every lane starts from the same state except for its block counter.
+  for (int i = 0; i < 16; i++) {
+    for (int l = 0; l < CHACHA_LANES; l++) {
+      start[i][l] = c->state[i];
+    }
+  }
+  for (int l = 0; l < CHACHA_LANES; l++) {
+    start[12][l] = (uint32_t) (counter + l);
+    start[13][l] = (uint32_t) ((counter + l) >> 32);
+  }
+  memcpy(x, start, sizeof(x));
+
+  // 20 rounds, each pair is a column round and a diagonal round.
+  for (int i = 0; i < 10; i++) {
+    chacha_quarter(x[0], x[4], x[8], x[12]);
+    chacha_quarter(x[1], x[5], x[9], x[13]);
+    chacha_quarter(x[2], x[6], x[10], x[14]);
+    chacha_quarter(x[3], x[7], x[11], x[15]);
+    chacha_quarter(x[0], x[5], x[10], x[15]);
+    chacha_quarter(x[1], x[6], x[11], x[12]);
+    chacha_quarter(x[2], x[7], x[8], x[13]);
+    chacha_quarter(x[3], x[4], x[9], x[14]);
+  }
+
+  // Block l of the output is lane l, written out little endian.
+  for (int i = 0; i < 16; i++) {
+    for (int l = 0; l < CHACHA_LANES; l++) {
+      uint32_t v = x[i][l] + start[i][l];
+      unsigned char *o = out + 64 * l + 4 * i;
+      o[0] = v;
+      o[1] = v >> 8;
+      o[2] = v >> 16;
+      o[3] = v >> 24;
+    }
+  }
+
+  // Move the block counter past the blocks used.
+  counter += CHACHA_LANES;
+  c->state[12] = (uint32_t) counter;
+  c->state[13] = (uint32_t) (counter >> 32);
+}
+
+
+/* Fills len chars of key with A-Z and SPACE, each equally likely, drawn from the generator. */
+void generate_key(struct chacha *c, char *key, long len) {
+  static const char symbols[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+  unsigned char bytes[CHACHA_LANES * 64];
+  // Maps every byte to its key char, so the loop below doesn't need a branch or a division.
+  char table[256];
+  for (int i = 0; i < 256; i++) {
+    table[i] = symbols[i % 27];
+  }
+
+  long filled = 0;
+  while (filled < len) {
+    chacha_blocks(c, bytes);
+
+    // Rejection sampling without branches: every byte is written, but the position only moves
+    // past the bytes that are kept, so a rejected byte is overwritten by the next one. While a
+    // whole batch fits, the loop doesn't need to check for the end of the key.
+    if (len - filled >= (long) sizeof(bytes)) {
+      for (int i = 0; i < (int) sizeof(bytes); i++) {
+        key[filled] = table[bytes[i]];
+        filled += (bytes[i] < KEY_REJECT);
+      }
+    } else {
+      for (int i = 0; i < (int) sizeof(bytes) && filled < len; i++) {
+        key[filled] = table[bytes[i]];
+        filled += (bytes[i] < KEY_REJECT);
+      }
+    }
+  }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,258 @@
+/* otp_agent keeps a pool of connections to the enc and dec servers that have already been
+   connected and authenticated, and hands requests from short lived clients to them. It listens
+   on a local socket and speaks the same protocol as the servers, so a client uses it by giving
+   the socket path in place of the port. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>     // intptr_t
+#include <pthread.h>
+#include "otp_client.h" // balancer, handshake(), exchange()
+
+
+// Most idle connections kept per server type.
+#define MAX_IDLE 256
+
+
+/* The connections for one type of server, either enc or dec. */
+struct pool {
+  // Identifier sent to the servers and expected from clients.
+  char cs_check[4];
+  // 0 when no endpoints were given for this type, clients asking for it are turned away.
+  int enabled;
+  // The servers and how many requests each has in flight.
+  struct balancer b;
+  // Authenticated connections waiting for a request, and the endpoint each one goes to.
+  int idle[MAX_IDLE], idle_targets[MAX_IDLE], idle_count;
+};
+
+struct pool pools[2];
+// Guards the pools, connections are opened and used outside of it.
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Takes a connection for a request, preferring an idle one to the least busy endpoint. Opens
+   and authenticates a new one if none are idle. Returns the socket and sets target to its
+   endpoint, or returns -1 once every endpoint is ejected. */
+int checkout(struct pool *p, int *target) {
+  pthread_mutex_lock(&pool_lock);
+
+  // Reuse the idle connection whose endpoint has the fewest requests in flight.
+  int best = -1;
+  for (int i = 0; i < p->idle_count; i++) {
+    if (best < 0 || p->b.list[p->idle_targets[i]].outstanding < p->b.list[p->idle_targets[best]].outstanding) {
+      best = i;
+    }
+  }
+  if (best >= 0) {
+    int socketFD = p->idle[best];
+    *target = p->idle_targets[best];
+    p->idle_count--;
+    p->idle[best] = p->idle[p->idle_count];
+    p->idle_targets[best] = p->idle_targets[p->idle_count];
+    p->b.list[*target].outstanding++;
+    pthread_mutex_unlock(&pool_lock);
+    return socketFD;
+  }
+
+  // Nothing idle, open a new connection to the least busy healthy endpoint.
+  int idx;
+  while ((idx = balancer_pick(&p->b)) >= 0) {
+    p->b.list[idx].outstanding++;
+    pthread_mutex_unlock(&pool_lock);
+
+    int socketFD = endpoint_connect(&p->b.list[idx]);
+    if (socketFD >= 0 && handshake(socketFD, p->cs_check, &p->b.list[idx]) == 0) {
+      *target = idx;
+      return socketFD;
+    }
+    if (socketFD >= 0) {
+      close(socketFD);
+    }
+
+    // The endpoint is down or is the wrong type of server, leave it out for a while.
+    pthread_mutex_lock(&pool_lock);
+    p->b.list[idx].outstanding--;
+    balancer_eject(&p->b, idx);
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+  return -1;
+}
+
+
+/* Gives a connection back after a request. Connections that failed are closed instead. */
+void checkin(struct pool *p, int socketFD, int target, int ok) {
+  pthread_mutex_lock(&pool_lock);
+  p->b.list[target].outstanding--;
+  if (ok && p->idle_count < MAX_IDLE) {
+    p->idle[p->idle_count] = socketFD;
+    p->idle_targets[p->idle_count] = target;
+    p->idle_count++;
+    socketFD = -1;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (socketFD >= 0) {
+    close(socketFD);
+  }
+}
+
+
+/* Handles one client connection. The client authenticates with the agent the same way it
+   would with a server, then each request is passed on over a pooled connection. */
+void* serve_client(void *arg) {
+  int clientFD = (int) (intptr_t) arg;
+  char cs_check[4], buff_size[11];
+  char authenticate[5] = "fals";
+  struct pool *p = NULL;
+
+  // Receives the identifer from the client (either enc or dec).
+  if (recv_all(clientFD, cs_check, sizeof(cs_check)) == 0) {
+    for (int i = 0; i < 2; i++) {
+      if (pools[i].enabled && strncmp(cs_check, pools[i].cs_check, 3) == 0) {
+        p = &pools[i];
+        strcpy(authenticate, "true");
+      }
+    }
+  }
+
+  // Clients asking for a type of server the agent has no endpoints for are turned away.
+  if (send_all(clientFD, authenticate, 5, 0) < 0 || p == NULL) {
+    close(clientFD);
+    return NULL;
+  }
+
+  // Handles requests until the client closes the connection.
+  memset(buff_size, '\0', sizeof(buff_size));
+  while (recv_all(clientFD, buff_size, 10) == 0) {
+    long count = atol(buff_size);
+
+    // One buffer holds the text, the key and the result.
+    char *text = malloc(3 * count + 1);
+    if (text == NULL) {
+      fprintf(stderr, "AGENT: ERROR allocating buffers for input\n");
+      break;
+    }
+    char *key = text + count, *result = key + count;
+    if (recv_all(clientFD, text, count) < 0 || recv_all(clientFD, key, count) < 0) {
+      free(text);
+      break;
+    }
+
+    // A pooled connection may have been closed by its server since it was last used, so a
+    // failed request is tried once more on another connection.
+    int done = 0;
+    for (int attempt = 0; attempt < 2 && !done; attempt++) {
+      int target;
+      int socketFD = checkout(p, &target);
+      if (socketFD < 0) {
+        break;
+      }
+      done = (exchange(socketFD, text, key, result, count) == 0);
+      checkin(p, socketFD, target, done);
+    }
+
+    // Closing the connection is the only way to tell the client the request failed.
+    if (!done || send_all(clientFD, result, count, 0) < 0) {
+      free(text);
+      break;
+    }
+    free(text);
+  }
+
+  close(clientFD);
+  return NULL;
+}
+
+
+/* Sets up the pool for one type of server. A list of "-" leaves the type disabled. */
+void pool_setup(struct pool *p, const char *cs_check, const char *endpoints, int connections) {
+  memset(p, '\0', sizeof(*p));
+  strcpy(p->cs_check, cs_check);
+  if (strcmp(endpoints, "-") == 0) {
+    return;
+  }
+  p->enabled = 1;
+  balancer_setup(&p->b, endpoints);
+
+  // Warm up the pool so the first requests don't pay for the connections either.
+  int sockets[MAX_IDLE], targets[MAX_IDLE], opened = 0;
+  for (int i = 0; i < connections && i < MAX_IDLE; i++) {
+    sockets[opened] = checkout(p, &targets[opened]);
+    if (sockets[opened] < 0) {
+      break;
+    }
+    opened++;
+  }
+  for (int i = 0; i < opened; i++) {
+    checkin(p, sockets[i], targets[i], 1);
+  }
+}
+
+
+/* Main, start of the otp_agent. */
+int main(int argc, char *argv[]) {
+
+  // Connections opened up front for each type of server, at least one.
+  int connections = (argc > 4) ? atoi(argv[4]) : 4;
+
+  // Check for the correct number of arguments.
+  if (argc < 4 || connections < 1) {
+    fprintf(stderr, "USAGE: %s socket_path enc_endpoints dec_endpoints [connections]\n", argv[0]);
+    exit(1);
+  }
+
+  // A server going away shouldn't kill the agent, the failed send is handled instead.
+  signal(SIGPIPE, SIG_IGN);
+
+  pool_setup(&pools[0], "enc", argv[2], connections);
+  pool_setup(&pools[1], "dec", argv[3], connections);
+
+  // Create the local socket that will listen for clients.
+  struct sockaddr_un address;
+  if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "AGENT: ERROR socket path too long\n");
+    exit(1);
+  }
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, argv[1]);
+
+  int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenSocket < 0) {
+    fprintf(stderr, "AGENT: ERROR opening socket\n");
+    exit(1);
+  }
+
+  // Remove a socket left behind by an earlier agent before binding.
+  unlink(argv[1]);
+  if (bind(listenSocket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    fprintf(stderr, "AGENT: ERROR on binding\n");
+    exit(1);
+  }
+  listen(listenSocket, 128);
+
+  // Accept clients and give each one its own thread.
+  while (1) {
+    int clientFD = accept(listenSocket, NULL, NULL);
+    if (clientFD < 0) {
+      fprintf(stderr, "AGENT: ERROR on accept\n");
+      continue;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_client, (void*) (intptr_t) clientFD) != 0) {
+      fprintf(stderr, "AGENT: ERROR creating thread\n");
+      close(clientFD);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  // Close the listening socket.
+  close(listenSocket);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,343 @@
+/* otp_bench drives enc_server or dec_server (or an otp_agent) with a number of concurrent
+   connections and reports the throughput and latency it sees. It speaks the same handshake
+   and length protocol as the clients.
+
+   Closed-loop (the default): each connection sends its next request as soon as the last one
+   comes back. Open-loop (-r rate): requests are sent on a fixed schedule no matter how fast the
+   server answers, and latency is measured from when a request was due to be sent, so a server
+   that falls behind shows up in the numbers instead of slowing the load down. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>       // log()
+#include <pthread.h>
+#include "otp.h"        // encrypt(), decrypt(), generate_key()
+#include "otp_client.h" // balancer, handshake(), exchange()
+
+
+// Latencies are kept in log-linear buckets like HdrHistogram: values below SUB_BUCKETS nanoseconds
+// get a bucket each, above that every power of two is split into SUB_BUCKETS / 2 buckets. That
+// keeps every recorded value within 1/64 (about 1.6%) of its real value.
+#define SUB_BUCKETS 128
+#define HALF_BUCKETS (SUB_BUCKETS / 2)
+#define BUCKETS (SUB_BUCKETS + 57 * HALF_BUCKETS)
+
+
+/* Counts of latencies in nanoseconds. */
+struct histogram {
+  long long counts[BUCKETS];
+  long long total, max;
+};
+
+
+/* Bucket a latency falls in. */
+int bucket_of(long long v) {
+  if (v < SUB_BUCKETS) {
+    return v;
+  }
+  // How far v has to be shifted to land in [HALF_BUCKETS, SUB_BUCKETS).
+  int shift = (63 - __builtin_clzll(v)) - 6;
+  return SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + (int) ((v >> shift) - HALF_BUCKETS);
+}
+
+
+/* Highest latency that falls in a bucket. */
+long long bucket_value(int b) {
+  if (b < SUB_BUCKETS) {
+    return b;
+  }
+  int shift = (b - SUB_BUCKETS) / HALF_BUCKETS + 1;
+  long long base = (long long) ((b - SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS) << shift;
+  return base + (1LL << shift) - 1;
+}
+
+
+void histogram_record(struct histogram *h, long long v) {
+  h->counts[bucket_of(v)]++;
+  h->total++;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+
+/* Latency below which the given fraction of the recorded values fall. */
+long long histogram_percentile(struct histogram *h, double fraction) {
+  long long wanted = (long long) (fraction * h->total + 0.5), seen = 0;
+  if (wanted < 1) {
+    wanted = 1;
+  }
+  for (int b = 0; b < BUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen >= wanted) {
+      long long v = bucket_value(b);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+
+/* Settings shared by every connection. */
+struct settings {
+  char cs_check[4];
+  // Message sizes are uniform between min_size and max_size, or exponential around mean_size.
+  long min_size, max_size, mean_size;
+  // Requests per second across all connections, 0 for closed-loop.
+  double rate;
+  // Run until this many requests have been sent or this many seconds have passed.
+  long long requests;
+  double seconds;
+  // Open a new connection for every request instead of keeping one.
+  int reconnect;
+  int connections;
+  struct balancer b;
+};
+
+struct settings config;
+
+
+/* What one connection did. */
+struct worker {
+  int id;
+  long long done, errors, bytes;
+  struct histogram latency;
+};
+
+
+/* Current time in nanoseconds. */
+long long now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/* Picks the size of the next message from the configured distribution. */
+long next_size(unsigned int *seed) {
+  if (config.mean_size > 0) {
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    long size = (long) (-config.mean_size * log(u));
+    return size < config.max_size ? size : config.max_size;
+  }
+  if (config.max_size == config.min_size) {
+    return config.min_size;
+  }
+  return config.min_size + rand_r(seed) % (config.max_size - config.min_size + 1);
+}
+
+
+/* Opens and authenticates a connection to this worker's endpoint. */
+int open_connection(struct endpoint *e) {
+  int socketFD = endpoint_connect(e);
+  if (socketFD >= 0 && handshake(socketFD, config.cs_check, e) != 0) {
+    close(socketFD);
+    socketFD = -1;
+  }
+  return socketFD;
+}
+
+
+/* Thread body, sends requests over one connection until the run is over. */
+void* run_worker(void *arg) {
+  struct worker *w = arg;
+  // Workers are spread over the endpoints in turn.
+  struct endpoint *e = &config.b.list[w->id % config.b.count];
+  unsigned int seed = w->id * 7919 + 1;
+
+  // Random text and key, generated once and reused for every request.
+  struct chacha generator;
+  if (chacha_seed(&generator) < 0) {
+    fprintf(stderr, "BENCH: ERROR seeding the generator\n");
+    exit(1);
+  }
+  char *text = malloc(config.max_size + 1), *key = malloc(config.max_size + 1);
+  char *result = malloc(config.max_size + 1), *expected = malloc(config.max_size + 1);
+  if (text == NULL || key == NULL || result == NULL || expected == NULL) {
+    fprintf(stderr, "BENCH: ERROR allocating the messages\n");
+    exit(1);
+  }
+  generate_key(&generator, text, config.max_size);
+  generate_key(&generator, key, config.max_size);
+  if (config.cs_check[0] == 'e') {
+    encrypt(expected, text, key, config.max_size);
+  } else {
+    decrypt(expected, text, key, config.max_size);
+  }
+
+  // This worker's share of the requests and of the rate.
+  long long requests = config.requests / config.connections + (w->id < config.requests % config.connections);
+  double interval = config.rate > 0 ? 1e9 * config.connections / config.rate : 0;
+
+  int socketFD = config.reconnect ? -1 : open_connection(e);
+  long long start = now_ns(), end = start + (long long) (config.seconds * 1e9);
+
+  for (long long i = 0; config.requests > 0 ? i < requests : now_ns() < end; i++) {
+    long size = next_size(&seed);
+
+    // Open-loop waits for the request's slot in the schedule, closed-loop goes right away.
+    long long due = now_ns();
+    if (interval > 0) {
+      due = start + (long long) (i * interval);
+      struct timespec t = { due / 1000000000LL, due % 1000000000LL };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+    }
+
+    if (socketFD < 0) {
+      socketFD = open_connection(e);
+    }
+    int ok = socketFD >= 0 && exchange(socketFD, text, key, result, size) == 0;
+
+    // Every response is checked against the transform done here.
+    if (ok && memcmp(result, expected, size) != 0) {
+      fprintf(stderr, "BENCH: wrong result from %s\n", e->name);
+      ok = 0;
+    }
+
+    if (ok) {
+      histogram_record(&w->latency, now_ns() - due);
+      w->done++;
+      w->bytes += size;
+    } else {
+      w->errors++;
+    }
+
+    // A failed connection is dropped and a new one opened for the next request.
+    if (socketFD >= 0 && (!ok || config.reconnect)) {
+      close(socketFD);
+      socketFD = -1;
+    }
+  }
+
+  if (socketFD >= 0) {
+    close(socketFD);
+  }
+  free(text);
+  free(key);
+  free(result);
+  free(expected);
+  return NULL;
+}
+
+
+/* Reads a size distribution: "N" for a fixed size, "MIN-MAX" for uniform sizes or "exp:MEAN"
+   for exponential sizes (capped at 16 times the mean). */
+void parse_sizes(const char *spec) {
+  config.mean_size = 0;
+  if (strncmp(spec, "exp:", 4) == 0) {
+    config.mean_size = atol(spec + 4);
+    config.min_size = 0;
+    config.max_size = config.mean_size * 16;
+  } else if (strchr(spec, '-') != NULL) {
+    config.min_size = atol(spec);
+    config.max_size = atol(strchr(spec, '-') + 1);
+  } else {
+    config.min_size = config.max_size = atol(spec);
+  }
+
+  if (config.min_size < 0 || config.max_size < config.min_size || config.max_size > MAX_SHARD_SIZE) {
+    fprintf(stderr, "BENCH: bad message sizes: %s\n", spec);
+    exit(1);
+  }
+}
+
+
+/* Main, start of the otp_bench. */
+int main(int argc, char *argv[]) {
+  const char *usage = "USAGE: %s [-t enc|dec] [-c connections] [-s size|min-max|exp:mean] [-r rate]\n"
+                      "       [-n requests | -d seconds] [-N] endpoints\n";
+
+  strcpy(config.cs_check, "enc");
+  config.connections = 1;
+  config.seconds = 10;
+  parse_sizes("1000");
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:s:r:n:d:N")) != -1) {
+    switch (opt) {
+      case 't':
+        if (strcmp(optarg, "enc") != 0 && strcmp(optarg, "dec") != 0) {
+          fprintf(stderr, usage, argv[0]);
+          exit(1);
+        }
+        strcpy(config.cs_check, optarg);
+        break;
+      case 'c':
+        config.connections = atoi(optarg);
+        break;
+      case 's':
+        parse_sizes(optarg);
+        break;
+      case 'r':
+        config.rate = atof(optarg);
+        break;
+      case 'n':
+        config.requests = atoll(optarg);
+        break;
+      case 'd':
+        config.seconds = atof(optarg);
+        break;
+      case 'N':
+        config.reconnect = 1;
+        break;
+      default:
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+  }
+  if (optind >= argc || config.connections < 1) {
+    fprintf(stderr, usage, argv[0]);
+    exit(1);
+  }
+  balancer_setup(&config.b, argv[optind]);
+
+  // A server going away shows up as an error, not a crash.
+  signal(SIGPIPE, SIG_IGN);
+
+  struct worker *workers = calloc(config.connections, sizeof(struct worker));
+  pthread_t ids[config.connections];
+  long long start = now_ns();
+
+  for (int i = 0; i < config.connections; i++) {
+    workers[i].id = i;
+    if (pthread_create(&ids[i], NULL, run_worker, &workers[i]) != 0) {
+      fprintf(stderr, "BENCH: ERROR creating thread\n");
+      exit(1);
+    }
+  }
+
+  // Adds every connection's results together.
+  struct histogram *all = calloc(1, sizeof(struct histogram));
+  long long done = 0, errors = 0, bytes = 0;
+  for (int i = 0; i < config.connections; i++) {
+    pthread_join(ids[i], NULL);
+    done += workers[i].done;
+    errors += workers[i].errors;
+    bytes += workers[i].bytes;
+    for (int b = 0; b < BUCKETS; b++) {
+      all->counts[b] += workers[i].latency.counts[b];
+    }
+    all->total += workers[i].latency.total;
+    if (workers[i].latency.max > all->max) {
+      all->max = workers[i].latency.max;
+    }
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("mode        %s, %s, %d connection(s)%s\n", config.cs_check, config.rate > 0 ? "open-loop" : "closed-loop",
+         config.connections, config.reconnect ? ", new connection per request" : "");
+  printf("requests    %lld ok, %lld errors in %.3f s\n", done, errors, elapsed);
+  printf("throughput  %.1f requests/s, %.2f MB/s\n", done / elapsed, bytes / elapsed / 1e6);
+  if (all->total > 0) {
+    printf("latency us  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           histogram_percentile(all, 0.50) / 1e3, histogram_percentile(all, 0.90) / 1e3,
+           histogram_percentile(all, 0.99) / 1e3, histogram_percentile(all, 0.999) / 1e3, all->max / 1e3);
+  }
+
+  free(all);
+  free(workers);
+  return errors > 0 ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,531 @@
+/* Shared client routines used by enc_client and dec_client. The clients only differ in the
+   identifier they send to the server and the names in their error messages. */
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>  // ssize_t
+#include <sys/socket.h> // send(),recv()
+#include <sys/mman.h>   // mmap()
+#include <sys/wait.h>   // waitpid()
+#include <sys/un.h>     // sockaddr_un
+#include <netdb.h>      // getaddrinfo()
+#include <time.h>
+
+
+// Smallest shard worth opening another connection for.
+#define MIN_SHARD_SIZE 65536
+// Largest shard the 9 digit size field sent to the server can describe.
+#define MAX_SHARD_SIZE 999999999
+// How long an endpoint is left out after a failed connection or a "fals" handshake.
+#define EJECT_SECONDS 30
+// Most endpoints that can be listed on the command line.
+#define MAX_ENDPOINTS 64
+
+
+/* One server the client can send requests to, either a TCP host and port or a local socket path. */
+struct endpoint {
+  // The endpoint as it was written on the command line, used in error messages.
+  char name[256];
+  // Address resolved once up front so each connection doesn't repeat the DNS lookup.
+  struct sockaddr_storage address;
+  socklen_t address_len;
+  // Requests currently in flight on this endpoint.
+  int outstanding;
+  // The endpoint isn't picked again until this time has passed.
+  time_t ejected_until;
+};
+
+/* The list of endpoints requests are spread across. */
+struct balancer {
+  struct endpoint list[MAX_ENDPOINTS];
+  int count;
+  // Where the search for the least busy endpoint starts, rotated so ties are spread out.
+  int next;
+};
+
+
+/* Checks len chars read from a text file. Returns how many come before the first newline (len if
+   there is none), or -1 if one of them is anything other than A-Z or SPACE. */
+long scan_text(const char *block, long len) {
+  for (long i = 0; i < len; i++) {
+    char ch = block[i];
+    if ((ch >= 65 && ch <= 90) || (ch == 32)) {
+      continue;
+
+    // We reached end of the text. 10 = '\n'
+    } else if (ch == 10) {
+      return i;
+
+    // Bad character.
+    } else {
+      return -1;
+    }
+  }
+  return len;
+}
+
+
+// 16 chars checked at once by scan_text_wide(), using GCC's vector extensions.
+typedef unsigned char scan_vector __attribute__((vector_size(16)));
+
+/* Same result as scan_text(). memchr() finds the newline, then the chars before it are checked
+   16 at a time without a branch per char. otp_microbench checks the two match. */
+long scan_text_wide(const char *block, long len) {
+  const char *newline = memchr(block, '\n', len);
+  long text_len = newline == NULL ? len : newline - block;
+
+  // A comparison gives all ones in the chars where it's true. Chars below 'A' wrap around to
+  // large values, so one compare covers both ends of A-Z.
+  scan_vector bad = {0};
+  long i = 0;
+  for (; i + 16 <= text_len; i += 16) {
+    scan_vector ch;
+    memcpy(&ch, block + i, 16);
+    bad |= (scan_vector) (ch - 65 > 25) & (scan_vector) (ch != 32);
+  }
+
+  // Folds the 16 chars of flags together, then checks the chars left over one at a time.
+  unsigned char any = 0;
+  for (int j = 0; j < 16; j++) {
+    any |= bad[j];
+  }
+  for (; i < text_len; i++) {
+    unsigned char ch = block[i];
+    any |= ((unsigned char) (ch - 65) > 25) & (ch != 32);
+  }
+  return any ? -1 : text_len;
+}
+
+
+/* Reads the text in a file up to the first newline into a new buffer and stores its length in count.
+   Exits if the file can't be opened or holds anything other than A-Z and SPACE. */
+char* read_text(const char *path, long *count, const char *file_name, const char *text_name) {
+
+  // Opens the file.
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Something is wrong with the %s\n", file_name);
+    exit(1);
+  }
+
+  long len = 0, size = MIN_SHARD_SIZE;
+  char *text = malloc(size);
+  if (text == NULL) {
+    fprintf(stderr, "CLIENT: ERROR allocating memory for the %s\n", text_name);
+    exit(1);
+  }
+  char block[MIN_SHARD_SIZE];
+  size_t block_len;
+  int done = 0;
+
+  // Reads the file a block at a time instead of a char at a time.
+  while (!done && (block_len = fread(block, 1, sizeof(block), fp)) > 0) {
+    long text_len = scan_text(block, block_len);
+
+    // Bad characters detected in the file.
+    if (text_len < 0) {
+      fprintf(stderr, "Bad character(s) detected in %s.\n", text_name);
+      exit(1);
+    }
+
+    // We reached end of the text, keep what came before it.
+    if (text_len < (long) block_len) {
+      block_len = text_len;
+      done = 1;
+    }
+
+    // Grows the buffer as needed so there's no limit on the text size.
+    while (len + (long) block_len > size) {
+      size *= 2;
+      char *grown = realloc(text, size);
+      if (grown == NULL) {
+        fprintf(stderr, "CLIENT: ERROR allocating memory for the %s\n", text_name);
+        free(text);
+        exit(1);
+      }
+      text = grown;
+    }
+    memcpy(text + len, block, block_len);
+    len += block_len;
+  }
+
+  // Close the file.
+  fclose(fp);
+
+  *count = len;
+  return text;
+}
+
+
+/* Sends all len bytes of buffer, picking up where a partial send() left off. Passing MSG_MORE
+   in flags holds the data back until the next send so small pieces go out together. */
+int send_all(int socketFD, const char *buffer, long len, int flags) {
+  long chars_written = 0;
+  while (chars_written < len) {
+    ssize_t sent = send(socketFD, buffer + chars_written, len - chars_written, flags | MSG_NOSIGNAL);
+    if (sent < 0) {
+      return -1;
+    }
+    chars_written += sent;
+  }
+  return 0;
+}
+
+
+/* Receives exactly len bytes into buffer. Returns -1 if the connection fails or closes early. */
+int recv_all(int socketFD, char *buffer, long len) {
+  long chars_read = 0;
+  while (chars_read < len) {
+    ssize_t got = recv(socketFD, buffer + chars_read, len - chars_read, 0);
+    if (got <= 0) {
+      return -1;
+    }
+    chars_read += got;
+  }
+  return 0;
+}
+
+
+/* Resolves one endpoint. "57000" and "host:57000" are TCP endpoints (the host defaults to
+   localhost), anything containing a '/' is the path of a local socket. Returns -1 if the
+   host can't be resolved. */
+int endpoint_setup(struct endpoint *e, const char *spec) {
+
+  // Clear out the endpoint.
+  memset(e, '\0', sizeof(*e));
+  snprintf(e->name, sizeof(e->name), "%s", spec);
+
+  // Local socket, used to reach servers or an agent on the same host.
+  if (strchr(spec, '/') != NULL) {
+    struct sockaddr_un *address = (struct sockaddr_un*) &e->address;
+    if (strlen(spec) >= sizeof(address->sun_path)) {
+      fprintf(stderr, "CLIENT: ERROR, socket path too long: %s\n", spec);
+      return -1;
+    }
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, spec);
+    e->address_len = sizeof(*address);
+    return 0;
+  }
+
+  // Split "host:port", a bare port number means localhost.
+  char host[256] = "localhost";
+  const char *port = spec;
+  const char *colon = strrchr(spec, ':');
+  if (colon != NULL) {
+    snprintf(host, sizeof(host), "%.*s", (int) (colon - spec), spec);
+    port = colon + 1;
+  }
+
+  // Get the DNS entry for this host name.
+  struct addrinfo hints, *info;
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &info) != 0) {
+    fprintf(stderr, "CLIENT: ERROR, no such host: %s\n", spec);
+    return -1;
+  }
+
+  // Copy the first address from the DNS entry.
+  memcpy(&e->address, info->ai_addr, info->ai_addrlen);
+  e->address_len = info->ai_addrlen;
+  freeaddrinfo(info);
+  return 0;
+}
+
+
+/* Fills the balancer from a comma separated list of endpoints. Endpoints that can't be
+   resolved are left ejected. Exits if the list is empty or too long. */
+void balancer_setup(struct balancer *b, const char *list) {
+  char copy[strlen(list) + 1];
+  strcpy(copy, list);
+
+  b->count = 0;
+  b->next = getpid() % MAX_ENDPOINTS;
+  for (char *spec = strtok(copy, ","); spec != NULL; spec = strtok(NULL, ",")) {
+    if (b->count == MAX_ENDPOINTS) {
+      fprintf(stderr, "CLIENT: ERROR, more than %d endpoints\n", MAX_ENDPOINTS);
+      exit(1);
+    }
+    struct endpoint *e = &b->list[b->count++];
+    if (endpoint_setup(e, spec) < 0) {
+      e->ejected_until = (time_t) -1;
+    }
+  }
+
+  if (b->count == 0) {
+    fprintf(stderr, "CLIENT: ERROR, no server endpoints given\n");
+    exit(1);
+  }
+}
+
+
+/* Picks the healthy endpoint with the fewest requests in flight. Returns its index or -1 if
+   every endpoint is ejected. */
+int balancer_pick(struct balancer *b) {
+  time_t now = time(NULL);
+  int best = -1;
+
+  for (int i = 0; i < b->count; i++) {
+    int idx = (b->next + i) % b->count;
+    struct endpoint *e = &b->list[idx];
+    // Skips endpoints that failed recently, unresolved endpoints are never retried.
+    if (e->ejected_until == (time_t) -1 || e->ejected_until > now) {
+      continue;
+    }
+    if (best < 0 || e->outstanding < b->list[best].outstanding) {
+      best = idx;
+    }
+  }
+
+  b->next = (b->next + 1) % b->count;
+  return best;
+}
+
+
+/* Leaves an endpoint out for EJECT_SECONDS after it failed a connection or a handshake. */
+void balancer_eject(struct balancer *b, int idx) {
+  b->list[idx].ejected_until = time(NULL) + EJECT_SECONDS;
+}
+
+
+/* Opens a connection to an endpoint. Returns the socket or -1. */
+int endpoint_connect(struct endpoint *e) {
+
+  // Create a socket to connect to the server.
+  int socketFD = socket(e->address.ss_family, SOCK_STREAM, 0);
+  if (socketFD < 0){
+    fprintf(stderr, "CLIENT: ERROR opening socket..\n");
+    return -1;
+  }
+
+  // Attempt a connnection to the server.
+  if (connect(socketFD, (struct sockaddr*) &e->address, e->address_len) < 0) {
+    fprintf(stderr, "CLIENT: ERROR connecting to %s\n", e->name);
+    close(socketFD);
+    return -1;
+  }
+
+  return socketFD;
+}
+
+
+/* First the client sents an authentication message to the server. If the correct server
+   is being connected to, then a valid authentication response will be sent back. Returns 0
+   when authenticated or the exit code the client should use (1 for errors, 2 for the wrong server). */
+int handshake(int socketFD, const char *cs_check, struct endpoint *e) {
+  char authenticate[5];
+
+  if (send_all(socketFD, cs_check, 4, 0) < 0) {
+    fprintf(stderr, "CLIENT: ERROR writing to socket indentifier\n");
+    return 1;
+  }
+
+  // Receives the authentication response from the server. It will either be "true" or "fals".
+  if (recv_all(socketFD, authenticate, 5) < 0) {
+    fprintf(stderr, "CLIENT: ERROR with server check\n");
+    return 1;
+  }
+
+  // The connection isn't authenticated.
+  if (strncmp(authenticate, "fals", 4) == 0) {
+    fprintf(stderr, "CLIENT: ERROR on port: %s exit(2)\n", e->name);
+    return 2;
+  }
+
+  return 0;
+}
+
+
+/* Sends the size, the text and the key on an authenticated connection, then reads the
+   transformed text into result. Returns 0 on success or 1 on errors. */
+int exchange(int socketFD, const char *text, const char *key, char *result, long count) {
+
+  // buff_size holds the text length as a fixed 10 byte field so the server can't read past it.
+  char buff_size[10];
+
+  // Convert the length of the text to a zero padded string so we can tell the server the length.
+  // Anything longer than 9 digits doesn't fit in the field.
+  if (count > MAX_SHARD_SIZE) {
+    fprintf(stderr, "CLIENT: ERROR %ld chars is too many to send at once\n", count);
+    return 1;
+  }
+  memset(buff_size, '\0', sizeof(buff_size));
+  snprintf(buff_size, sizeof(buff_size), "%09ld", count);
+
+  // Sending the buffer length, the text and then the key to the server. The length and text are
+  // held back until the key is sent, otherwise Nagle's algorithm stalls the small sends until
+  // the server's delayed ACK comes back.
+  if (send_all(socketFD, buff_size, sizeof(buff_size), MSG_MORE) < 0) {
+    fprintf(stderr, "CLIENT: ERROR sendingg size of buffer to server.\n");
+    return 1;
+  }
+  if (send_all(socketFD, text, count, MSG_MORE) < 0) {
+    perror("Error: ");
+    fprintf(stderr, "CLIENT: ERROR sending text to server.\n");
+    return 1;
+  }
+  if (send_all(socketFD, key, count, 0) < 0) {
+    fprintf(stderr, "CLIENT: ERROR sending keytext to server.\n");
+    return 1;
+  }
+
+  // Receive the transformed text back from the server.
+  if (recv_all(socketFD, result, count) < 0) {
+    fprintf(stderr, "CLIENT: ERROR receiving text from server\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* Runs one whole request against an endpoint on a new connection. Returns 0 on success or
+   the exit code the client should use (1 for errors, 2 for the wrong server). */
+int transfer(const char *cs_check, struct endpoint *e, const char *text, const char *key, char *result, long count) {
+
+  int socketFD = endpoint_connect(e);
+  if (socketFD < 0) {
+    return 1;
+  }
+
+  int code = handshake(socketFD, cs_check, e);
+  if (code == 0) {
+    code = exchange(socketFD, text, key, result, count);
+  }
+
+  // Close the socket.
+  close(socketFD);
+  return code;
+}
+
+
+/* Cuts the text and the matching key range into contiguous shards and sends each one over its
+   own connection from a forked child. The transform is done char by char, so every shard can be
+   handled by a different server child and the results just land next to each other in result.
+   Shards go to the least busy endpoint in the list, and a shard whose endpoint fails is sent
+   again to another one. Returns the buffer holding all count transformed chars, exits with the
+   failed shard's code once no endpoint is left to try. */
+char* transfer_shards(const char *cs_check, const char *endpoints, const char *text, const char *key, long count, int connections) {
+
+  struct balancer b;
+  balancer_setup(&b, endpoints);
+
+  // Don't open connections for shards too small to be worth it, or shards too large to describe.
+  if (connections > count / MIN_SHARD_SIZE) {
+    connections = count / MIN_SHARD_SIZE;
+  }
+  if (connections < (count + MAX_SHARD_SIZE - 1) / MAX_SHARD_SIZE) {
+    connections = (count + MAX_SHARD_SIZE - 1) / MAX_SHARD_SIZE;
+  }
+  if (connections < 1) {
+    connections = 1;
+  }
+
+  // Shared with the children so each one can write its shard of the results in place.
+  char *result = mmap(NULL, count + 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED) {
+    fprintf(stderr, "CLIENT: ERROR allocating the result buffer\n");
+    exit(1);
+  }
+
+  // Exit code of the last failure, used once every endpoint has been ejected.
+  int exit_code = 1;
+
+  // A single connection doesn't need a child process.
+  if (connections == 1) {
+    int idx;
+    while ((idx = balancer_pick(&b)) >= 0) {
+      exit_code = transfer(cs_check, &b.list[idx], text, key, result, count);
+      if (exit_code == 0) {
+        return result;
+      }
+      balancer_eject(&b, idx);
+    }
+    exit(exit_code);
+  }
+
+  // Each shard remembers its range, the child sending it and the endpoint it went to.
+  long starts[connections], lens[connections];
+  pid_t children[connections];
+  int targets[connections], pending[connections];
+  int pending_count = 0, running = 0, finished = 0;
+
+  for (int i = 0; i < connections; i++) {
+    // The remainder is spread over the shards, so none is more than one char longer than
+    // another and none goes past MAX_SHARD_SIZE.
+    starts[i] = i * count / connections;
+    lens[i] = (i + 1) * count / connections - starts[i];
+    children[i] = 0;
+    pending[pending_count++] = i;
+  }
+
+  while (finished < connections) {
+
+    // Start a child for every shard still waiting on an endpoint.
+    while (pending_count > 0) {
+      int i = pending[--pending_count];
+      int idx = balancer_pick(&b);
+      if (idx < 0) {
+        // Nothing left to try, let the running shards finish before giving up.
+        while (running-- > 0) {
+          wait(NULL);
+        }
+        exit(exit_code);
+      }
+
+      targets[i] = idx;
+      b.list[idx].outstanding++;
+      children[i] = fork();
+      switch (children[i]) {
+        // Failed fork, something went horribly wrong.
+        case -1:
+          fprintf(stderr, "CLIENT: ERROR fork child process.\n");
+          exit(1);
+          break;
+        // Each child handles one shard and reports back through its exit code.
+        case 0:
+          _exit(transfer(cs_check, &b.list[idx], text + starts[i], key + starts[i], result + starts[i], lens[i]));
+          break;
+      }
+      running++;
+    }
+
+    // Wait on the next shard to finish.
+    int childStatus;
+    pid_t childPid = wait(&childStatus);
+    if (childPid < 0) {
+      fprintf(stderr, "CLIENT: ERROR waiting on shards\n");
+      exit(1);
+    }
+    running--;
+
+    for (int i = 0; i < connections; i++) {
+      if (children[i] != childPid) {
+        continue;
+      }
+      children[i] = 0;
+      b.list[targets[i]].outstanding--;
+      int code = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 1;
+
+      // A failed shard ejects its endpoint and goes back in line for another one.
+      if (code != 0) {
+        exit_code = code;
+        balancer_eject(&b, targets[i]);
+        pending[pending_count++] = i;
+      } else {
+        finished++;
+      }
+      break;
+    }
+  }
+
+  return result;
+}
+
+#endif
\ No newline at end of file
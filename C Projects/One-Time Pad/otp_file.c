@@ -0,0 +1,223 @@
+/* otp_file runs the same transform as enc_server and dec_server directly on files, without going
+   through a server. The input and key files are mapped into memory, the text is split into one
+   range per thread and each thread writes its part of the output file with pwrite(). The output
+   matches what enc_client or dec_client would print for the same files. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/stat.h>   // fstat()
+#include "otp.h"        // encrypt(), decrypt()
+
+
+// Each thread transforms and writes its range this many chars at a time.
+#define BLOCK_SIZE (1 << 20)
+
+
+/* The range of the text one thread is responsible for. */
+struct range {
+  const char *text, *key;
+  long start, len;
+  int outputFD;
+  // 1 for encrypting, 0 for decrypting.
+  int enc;
+  // Set by the thread: 1 if it found a bad char, 2 if it had no memory, -1 if writing failed.
+  int error;
+};
+
+
+/* Maps a whole file into memory. Empty files give an empty string. */
+const char* map_file(const char *path, long *size, const char *file_name) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    fprintf(stderr, "Something is wrong with the %s\n", file_name);
+    exit(1);
+  }
+
+  *size = info.st_size;
+  if (*size == 0) {
+    close(fd);
+    return "";
+  }
+
+  const char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Something is wrong with the %s\n", file_name);
+    exit(1);
+  }
+  // The input is read front to back.
+  madvise((void*) data, *size, MADV_SEQUENTIAL);
+  close(fd);
+  return data;
+}
+
+
+/* Length of the text in a mapped file, which ends at the first newline like in the clients. */
+long text_length(const char *data, long size) {
+  const char *newline = memchr(data, '\n', size);
+  return newline == NULL ? size : newline - data;
+}
+
+
+/* Returns 1 if every char is A-Z or SPACE. */
+int valid_text(const char *text, long len) {
+  for (long i = 0; i < len; i++) {
+    if (!((text[i] >= 65 && text[i] <= 90) || (text[i] == 32))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/* Thread body, checks and transforms one range of the text and writes it to the output. */
+void* transform_range(void *arg) {
+  struct range *r = arg;
+  char *block = malloc(BLOCK_SIZE);
+  if (block == NULL) {
+    r->error = 2;
+    return NULL;
+  }
+
+  for (long done = 0; done < r->len; done += BLOCK_SIZE) {
+    long len = r->len - done < BLOCK_SIZE ? r->len - done : BLOCK_SIZE;
+    const char *text = r->text + r->start + done, *key = r->key + r->start + done;
+
+    if (!valid_text(text, len)) {
+      r->error = 1;
+      break;
+    }
+
+    if (r->enc) {
+      encrypt(block, text, key, len);
+    } else {
+      decrypt(block, text, key, len);
+    }
+
+    // Each thread writes straight to its own offset, no locking needed.
+    long written = 0;
+    while (written < len) {
+      ssize_t n = pwrite(r->outputFD, block + written, len - written, r->start + done + written);
+      if (n < 0) {
+        r->error = -1;
+        break;
+      }
+      written += n;
+    }
+    if (r->error) {
+      break;
+    }
+  }
+
+  free(block);
+  return NULL;
+}
+
+
+/* Main, start of otp_file. */
+int main(int argc, char *argv[]) {
+
+  // Check for the correct number of arguments.
+  if (argc < 5 || (strcmp(argv[1], "enc") != 0 && strcmp(argv[1], "dec") != 0)) {
+    fprintf(stderr, "USAGE: %s enc|dec input key output [threads]\n", argv[0]);
+    exit(1);
+  }
+
+  int enc = (strcmp(argv[1], "enc") == 0);
+  const char *text_name = enc ? "plaintext" : "ciphertext";
+  char file_name[64];
+  snprintf(file_name, sizeof(file_name), "%s file, argv[2]", text_name);
+
+  // One thread per core unless told otherwise.
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 5) {
+    threads = atoi(argv[5]);
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  long text_size, key_size;
+  const char *text = map_file(argv[2], &text_size, file_name);
+  const char *key = map_file(argv[3], &key_size, "keytext file, argv[3]");
+  long count = text_length(text, text_size), key_count = text_length(key, key_size);
+
+  // The whole key is checked, the same as the clients do.
+  if (!valid_text(key, key_count)) {
+    fprintf(stderr, "Bad character(s) detected in key file.\n");
+    exit(1);
+  }
+
+  // Checking to see if the key file is large enough.
+  if (count > key_count) {
+    fprintf(stderr, "The key file isn't large enough, submit another key file.\n");
+    exit(1);
+  }
+
+  // Opens the output and sizes it up front so the threads can write anywhere in it.
+  int outputFD = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (outputFD < 0 || ftruncate(outputFD, count + 1) < 0) {
+    fprintf(stderr, "Something is wrong with the output file, argv[4]\n");
+    exit(1);
+  }
+
+  // Small texts aren't worth a thread each.
+  if (threads > count / BLOCK_SIZE) {
+    threads = count / BLOCK_SIZE;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  struct range ranges[threads];
+  pthread_t ids[threads];
+  long chunk = count / threads;
+
+  for (int i = 0; i < threads; i++) {
+    ranges[i].text = text;
+    ranges[i].key = key;
+    ranges[i].start = i * chunk;
+    // The last range picks up the remainder.
+    ranges[i].len = (i == threads - 1) ? count - ranges[i].start : chunk;
+    ranges[i].outputFD = outputFD;
+    ranges[i].enc = enc;
+    ranges[i].error = 0;
+    if (pthread_create(&ids[i], NULL, transform_range, &ranges[i]) != 0) {
+      fprintf(stderr, "ERROR creating thread\n");
+      exit(1);
+    }
+  }
+
+  int error = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    if (error == 0) {
+      error = ranges[i].error;
+    }
+  }
+
+  // Bad characters detected in the text file.
+  if (error == 1) {
+    fprintf(stderr, "Bad character(s) detected in %s.\n", text_name);
+    unlink(argv[4]);
+    exit(1);
+  }
+  if (error == 2) {
+    fprintf(stderr, "ERROR allocating memory\n");
+    unlink(argv[4]);
+    exit(1);
+  }
+
+  // Add a newline char on the end like the clients do.
+  if (error < 0 || pwrite(outputFD, "\n", 1, count) != 1) {
+    fprintf(stderr, "ERROR writing the output file\n");
+    exit(1);
+  }
+
+  close(outputFD);
+  return 0;
+}
\ No newline at end of file
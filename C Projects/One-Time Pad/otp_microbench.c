@@ -0,0 +1,193 @@
+/* otp_microbench times the routines that do the work in the servers, clients and keygen on their
+   own, without any sockets or files, for sizes from 16 chars up to 1 GB. Where a routine has more
+   than one version (the plain loop and the 16 chars at a time one) every version is run on the
+   same input and its output is checked against the first one.
+
+   Results go to stdout as a table, and with -o to a CSV file with one line per routine, version
+   and size so runs from different commits can be compared. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "otp.h"        // encrypt(), decrypt(), generate_key()
+#include "otp_client.h" // scan_text()
+
+
+// Sizes start here and go up by 4 times each step.
+#define MIN_SIZE 16
+#define SIZE_STEP 4
+
+
+/* One version of a routine. Exactly one of the function pointers is set, depending on the kind. */
+struct routine {
+  const char *name, *variant;
+  // encrypt() and decrypt() and their wide versions.
+  void (*transform)(char*, const char*, const char*, long);
+  // The clients' check of the text read from a file.
+  long (*scan)(const char*, long);
+  // keygen's generation loop.
+  void (*keygen)(struct chacha*, char*, long);
+};
+
+// Versions of the same routine are listed together, the first one is the reference.
+struct routine routines[] = {
+  { "encrypt", "scalar", encrypt, NULL, NULL },
+  { "encrypt", "wide", encrypt_wide, NULL, NULL },
+  { "decrypt", "scalar", decrypt, NULL, NULL },
+  { "decrypt", "wide", decrypt_wide, NULL, NULL },
+  { "scan_text", "scalar", NULL, scan_text, NULL },
+  { "scan_text", "wide", NULL, scan_text_wide, NULL },
+  { "generate_key", "chacha20", NULL, NULL, generate_key },
+};
+
+// Inputs and outputs, each as large as the largest size.
+char *text, *key, *reference, *output;
+// Result of the scan routines, kept so the calls can't be optimized away.
+volatile long scan_result;
+struct chacha generator;
+
+
+/* Current time in nanoseconds. */
+long long now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/* Runs a routine once on size chars, writing to out. Returns the scan result for scan routines. */
+long run_once(struct routine *r, char *out, long size) {
+  if (r->transform != NULL) {
+    r->transform(out, text, key, size);
+  } else if (r->scan != NULL) {
+    scan_result = r->scan(text, size);
+    return scan_result;
+  } else {
+    r->keygen(&generator, out, size);
+  }
+  return 0;
+}
+
+
+/* Times a routine on size chars. The number of runs doubles until a batch of them takes at least
+   min_ns, so small sizes aren't lost in the cost of reading the clock. Returns nanoseconds per run. */
+double time_routine(struct routine *r, long size, long long min_ns, long *runs) {
+  long long elapsed;
+  *runs = 1;
+  while (1) {
+    long long start = now_ns();
+    for (long i = 0; i < *runs; i++) {
+      run_once(r, output, size);
+    }
+    elapsed = now_ns() - start;
+    if (elapsed >= min_ns) {
+      break;
+    }
+    *runs *= 2;
+  }
+  return (double) elapsed / *runs;
+}
+
+
+/* Main, start of the otp_microbench. */
+int main(int argc, char *argv[]) {
+  const char *usage = "USAGE: %s [-m max_size] [-t min_seconds] [-o results.csv]\n";
+  long max_size = 1L << 30;
+  double min_seconds = 0.1;
+  const char *results_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:o:")) != -1) {
+    switch (opt) {
+      case 'm':
+        max_size = atol(optarg);
+        break;
+      case 't':
+        min_seconds = atof(optarg);
+        break;
+      case 'o':
+        results_path = optarg;
+        break;
+      default:
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+  }
+  if (max_size < MIN_SIZE) {
+    fprintf(stderr, usage, argv[0]);
+    exit(1);
+  }
+
+  // The key is the same random chars as the text, shifted by a few, which saves a whole buffer
+  // at the largest sizes.
+  text = malloc(max_size + 64);
+  reference = malloc(max_size);
+  output = malloc(max_size);
+  if (text == NULL || reference == NULL || output == NULL) {
+    fprintf(stderr, "MICROBENCH: ERROR allocating %ld byte buffers, try a smaller -m\n", max_size);
+    exit(1);
+  }
+  key = text + 61;
+  if (chacha_seed(&generator) < 0) {
+    perror("MICROBENCH: getrandom()");
+    exit(1);
+  }
+  generate_key(&generator, text, max_size + 64);
+
+  FILE *results = NULL;
+  if (results_path != NULL) {
+    results = fopen(results_path, "w");
+    if (results == NULL) {
+      fprintf(stderr, "MICROBENCH: ERROR opening %s\n", results_path);
+      exit(1);
+    }
+    fprintf(results, "routine,variant,bytes,runs,ns_per_byte,gb_per_s,matches\n");
+  }
+
+  printf("%-13s %-8s %12s %10s %9s %8s\n", "routine", "variant", "bytes", "ns/byte", "GB/s", "matches");
+  int count = sizeof(routines) / sizeof(routines[0]), mismatches = 0, ref_index = 0;
+
+  for (int i = 0; i < count; i++) {
+    struct routine *r = &routines[i];
+    // The first version of each routine is the one the others are checked against.
+    int is_reference = (i == 0 || strcmp(routines[i - 1].name, r->name) != 0);
+    if (is_reference) {
+      ref_index = i;
+    }
+
+    for (long size = MIN_SIZE; size <= max_size; size *= SIZE_STEP) {
+      // Checks the output against the reference on the same input before timing.
+      const char *matches = "-";
+      if (!is_reference) {
+        struct routine *ref = &routines[ref_index];
+        long expected = run_once(ref, reference, size), got = run_once(r, output, size);
+        int same = (r->scan != NULL) ? expected == got : memcmp(reference, output, size) == 0;
+        matches = same ? "yes" : "NO";
+        if (!same) {
+          mismatches++;
+        }
+      }
+
+      long runs;
+      double ns = time_routine(r, size, (long long) (min_seconds * 1e9), &runs);
+      double ns_per_byte = ns / size, gb_per_s = size / ns;
+
+      printf("%-13s %-8s %12ld %10.4f %9.3f %8s\n", r->name, r->variant, size, ns_per_byte, gb_per_s, matches);
+      fflush(stdout);
+      if (results != NULL) {
+        fprintf(results, "%s,%s,%ld,%ld,%.6f,%.6f,%s\n", r->name, r->variant, size, runs, ns_per_byte, gb_per_s, matches);
+      }
+    }
+  }
+
+  if (results != NULL) {
+    fclose(results);
+  }
+
+  if (mismatches > 0) {
+    fprintf(stderr, "MICROBENCH: %d result(s) didn't match the reference\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
\ No newline at end of file
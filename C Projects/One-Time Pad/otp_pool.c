@@ -0,0 +1,244 @@
+/* otp_pool generates key material ahead of time into a bounded ring in memory and hands out
+   unused segments of it over a local socket. A background thread tops the ring back up whenever
+   it drops below the low-water mark, so clients asking for a key don't wait on generating it.
+
+   Every segment handed out is described by (pool ID, offset, length), where offsets count every
+   char ever asked for, so no two segments overlap. The pool ID is random per run, so a segment is
+   never given out twice.
+
+   Protocol: the client sends the length it wants as a zero padded 20 byte field. The pool sends
+   back a 64 byte header holding the pool ID and the offset, then the key chars. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>     // intptr_t
+#include <errno.h>
+#include <ctype.h>      // isdigit()
+#include <pthread.h>
+#include "otp.h"        // chacha_seed(), generate_key()
+#include "otp_client.h" // send_all(), recv_all()
+
+
+// Key chars are generated and handed out this many at a time.
+#define POOL_CHUNK 65536
+// Size of the header sent before the key chars.
+#define POOL_HEADER 64
+
+
+/* The ring of key chars. head and tail count every char ever taken and made, so the chars ready
+   to hand out are the ones from head to tail, found at offset % capacity in the ring. reserved
+   counts every char asked for, the next segment starts at that offset. */
+char *ring;
+long long capacity, low_water, head = 0, tail = 0, reserved = 0;
+unsigned long long pool_id;
+
+// Guards head, tail and reserved. refilled is signalled when chars are added, drained when
+// they're taken.
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refilled = PTHREAD_COND_INITIALIZER, drained = PTHREAD_COND_INITIALIZER;
+
+
+/* Background thread that keeps the ring topped up. It waits until the ring drops below the
+   low-water mark, then fills it back to capacity. Only this thread writes to the ring, and the
+   chars past tail aren't read by anyone, so they're generated without holding the lock. */
+void* refill(void *arg) {
+  struct chacha generator;
+  if (chacha_seed(&generator) < 0) {
+    perror("POOL: getrandom()");
+    exit(1);
+  }
+
+  while (1) {
+    pthread_mutex_lock(&ring_lock);
+    while (tail - head > low_water) {
+      pthread_cond_wait(&drained, &ring_lock);
+    }
+    long long space = capacity - (tail - head), start = tail;
+    pthread_mutex_unlock(&ring_lock);
+
+    while (space > 0) {
+      // Stops at the end of the ring, the next chunk wraps around to the front.
+      long long pos = start % capacity;
+      long long len = space < POOL_CHUNK ? space : POOL_CHUNK;
+      if (len > capacity - pos) {
+        len = capacity - pos;
+      }
+      generate_key(&generator, ring + pos, len);
+      start += len;
+      space -= len;
+
+      // Makes the new chars available to clients as soon as each chunk is done.
+      pthread_mutex_lock(&ring_lock);
+      tail = start;
+      pthread_cond_broadcast(&refilled);
+      pthread_mutex_unlock(&ring_lock);
+    }
+  }
+  return NULL;
+}
+
+
+/* Handles one client request, sending the header and then len key chars from the ring. The
+   segment's offsets are reserved all at once, then its chars are taken from the ring a chunk at
+   a time. Only that bookkeeping and the copy of a chunk happen under the lock, the sends don't,
+   so clients are served side by side and a slow one holds up nobody else. */
+void* serve_client(void *arg) {
+  int clientFD = (int) (intptr_t) arg;
+  char length[21], header[POOL_HEADER];
+
+  memset(length, '\0', sizeof(length));
+  if (recv_all(clientFD, length, 20) < 0) {
+    close(clientFD);
+    return NULL;
+  }
+
+  // The length has to be all digits, anything else gets no header and no chars.
+  char *end;
+  errno = 0;
+  long long len = strtoll(length, &end, 10);
+  if (!isdigit((unsigned char) length[0]) || *end != '\0' || errno != 0 || len < 1) {
+    fprintf(stderr, "POOL: bad request length\n");
+    close(clientFD);
+    return NULL;
+  }
+  char *chunk = malloc(POOL_CHUNK);
+  if (chunk == NULL) {
+    fprintf(stderr, "POOL: ERROR allocating a chunk\n");
+    close(clientFD);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ring_lock);
+  long long offset = reserved;
+  reserved += len;
+  pthread_mutex_unlock(&ring_lock);
+
+  memset(header, '\0', sizeof(header));
+  snprintf(header, sizeof(header), "%016llx %020lld", pool_id, offset);
+
+  int ok = (send_all(clientFD, header, sizeof(header), 0) == 0);
+  while (ok && len > 0) {
+    // Waits for the refill thread if the ring has run dry, only happens for segments
+    // larger than the low-water mark or many clients at once.
+    pthread_mutex_lock(&ring_lock);
+    while (tail == head) {
+      pthread_cond_signal(&drained);
+      pthread_cond_wait(&refilled, &ring_lock);
+    }
+
+    long long pos = head % capacity;
+    long long n = tail - head;
+    if (n > len) {
+      n = len;
+    }
+    if (n > POOL_CHUNK) {
+      n = POOL_CHUNK;
+    }
+    if (n > capacity - pos) {
+      n = capacity - pos;
+    }
+
+    // The chars are copied out before head moves past them and the refill thread can write over
+    // them. From then on they belong to this client and are never handed out again.
+    memcpy(chunk, ring + pos, n);
+    head += n;
+    if (tail - head <= low_water) {
+      pthread_cond_signal(&drained);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    ok = (send_all(clientFD, chunk, n, 0) == 0);
+    len -= n;
+  }
+
+  free(chunk);
+  close(clientFD);
+  return NULL;
+}
+
+
+/* Main, start of the otp_pool. */
+int main(int argc, char *argv[]) {
+
+  // Check for the correct number of arguments.
+  if (argc < 3) {
+    fprintf(stderr, "USAGE: %s socket_path capacity [low_water]\n", argv[0]);
+    exit(1);
+  }
+
+  capacity = atoll(argv[2]);
+  low_water = argc > 3 ? atoll(argv[3]) : capacity / 2;
+  if (capacity < 1 || low_water < 0 || low_water >= capacity) {
+    fprintf(stderr, "POOL: capacity must be positive and low_water smaller than it\n");
+    exit(1);
+  }
+
+  ring = malloc(capacity);
+  if (ring == NULL) {
+    fprintf(stderr, "POOL: ERROR allocating the ring\n");
+    exit(1);
+  }
+
+  // A random ID tells segments of this run apart from segments of earlier runs.
+  if (getrandom(&pool_id, sizeof(pool_id), 0) != sizeof(pool_id)) {
+    perror("POOL: getrandom()");
+    exit(1);
+  }
+
+  // A client going away shouldn't kill the pool.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Start filling the ring before taking requests.
+  pthread_t refiller;
+  if (pthread_create(&refiller, NULL, refill, NULL) != 0) {
+    fprintf(stderr, "POOL: ERROR creating thread\n");
+    exit(1);
+  }
+
+  // Create the local socket that will listen for clients.
+  struct sockaddr_un address;
+  if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "POOL: ERROR socket path too long\n");
+    exit(1);
+  }
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, argv[1]);
+
+  int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenSocket < 0) {
+    fprintf(stderr, "POOL: ERROR opening socket\n");
+    exit(1);
+  }
+
+  // Remove a socket left behind by an earlier pool before binding.
+  unlink(argv[1]);
+  if (bind(listenSocket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    fprintf(stderr, "POOL: ERROR on binding\n");
+    exit(1);
+  }
+  listen(listenSocket, 128);
+
+  // Accept clients and give each one its own thread.
+  while (1) {
+    int clientFD = accept(listenSocket, NULL, NULL);
+    if (clientFD < 0) {
+      fprintf(stderr, "POOL: ERROR on accept\n");
+      continue;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_client, (void*) (intptr_t) clientFD) != 0) {
+      fprintf(stderr, "POOL: ERROR creating thread\n");
+      close(clientFD);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  // Close the listening socket.
+  close(listenSocket);
+  return 0;
+}
\ No newline at end of file
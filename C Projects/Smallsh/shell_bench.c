@@ -0,0 +1,516 @@
+/* shell_bench feeds the same scripted command streams to smallsh, dash and bash and times how
+ * each one handles them. The shell reads its commands from a pipe, or from a pseudo terminal with
+ * -p, and everything it prints is read back and searched for the reply to each command.
+ *
+ * MEASUREMENTS:
+ * - Round trip: the echo builtin printing a line, timed from writing the line to reading the
+ *   reply. This is the shell's own cost per command line.
+ * - Exec: the same with /bin/echo, which has to be forked and executed. Exec minus round trip
+ *   is the fork+exec cost.
+ * - Commands/s: a batch of /bin/true lines written all at once, timed until the shell answers the
+ *   builtin that follows them.
+ * - Reaping: a short background sleep is started and its entry in /proc is watched. The time from
+ *   the process exiting (becoming a zombie) to it being gone is how long the shell took to reap it.
+ *   Jobs still not reaped after REAP_TIMEOUT_MS are counted as unreaped.
+ *
+ * With -j the runs are repeated with that many idle background jobs started first, to show how
+ * the per-command costs change as the job count grows.
+ */
+
+
+// memmem() and the pseudo terminal calls.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+// How long to wait for a reply before giving up on a shell.
+#define REPLY_TIMEOUT_MS 5000
+// How long a finished background job is watched before it's counted as unreaped.
+#define REAP_TIMEOUT_MS 500
+// How long the background jobs in the reaping test run for.
+#define REAP_SLEEP "0.02"
+
+
+/* How to talk to one kind of shell. */
+struct shell {
+    // Name shown in the results and the command to start it.
+    const char *name;
+    char *argv[5];
+    // A builtin command line and text that only shows up in its reply.
+    const char *builtin, *builtin_reply;
+    // Lines that start a background sleep (%s is the time) and the text that comes right before
+    // the new job's pid in the reply.
+    const char *background, *background_pid;
+};
+
+struct shell shells[] = {
+    { "smallsh", { "./smallsh", NULL }, "echo BENCH\n", "BENCH", "sleep %s &\n", "background pid is " },
+    { "dash", { "dash", NULL }, "echo BENCH\n", "BENCH", "sleep %s &\necho BGPID $!\n", "BGPID " },
+    // Without --noediting, readline turns echo back on in a pty and the commands come back as replies.
+    { "bash", { "bash", "--norc", "--noprofile", "--noediting", NULL }, "echo BENCH\n", "BENCH", "sleep %s &\necho BGPID $!\n", "BGPID " },
+};
+
+
+/* Settings for a run. */
+int rounds = 100, batch = 200, reap_samples = 20, use_pty = 0;
+
+
+/* A running shell, what's been written to it and what it's printed. */
+struct session {
+    struct shell *sh;
+    pid_t pid;
+    int in, out;
+    // The parent's end of the pseudo terminal's slave side, or -1 with pipes.
+    int slave;
+    char buffer[65536];
+    int len;
+};
+
+
+/* Current time in nanoseconds. */
+long long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/* Starts a shell in its own session, reading from a pipe or a pseudo terminal. Returns 0 or -1. */
+int session_start(struct session *s, struct shell *sh) {
+    int in[2], out[2];
+    memset(s, '\0', sizeof(*s));
+    s->sh = sh;
+    s->slave = -1;
+
+    if (use_pty) {
+        // One pseudo terminal carries both directions, with echo off so the input doesn't come back.
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+            perror("posix_openpt()");
+            return -1;
+        }
+        s->slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+        struct termios mode;
+        tcgetattr(s->slave, &mode);
+        mode.c_lflag &= ~(ECHO | ECHONL);
+        tcsetattr(s->slave, TCSANOW, &mode);
+        s->in = s->out = master;
+    } else {
+        if (pipe(in) < 0 || pipe(out) < 0) {
+            perror("pipe()");
+            return -1;
+        }
+        s->in = in[1];
+        s->out = out[0];
+    }
+
+    s->pid = fork();
+    if (s->pid < 0) {
+        perror("fork()");
+        return -1;
+    }
+
+    if (s->pid == 0) {
+        // The shell and everything it starts share a session, so it can all be killed at the end.
+        setsid();
+        if (use_pty) {
+            // Opening the terminal again after setsid() makes it the controlling terminal.
+            close(s->slave);
+            int slave = open(ptsname(s->in), O_RDWR);
+            dup2(slave, 0);
+            dup2(slave, 1);
+            dup2(slave, 2);
+        } else {
+            dup2(in[0], 0);
+            dup2(out[1], 1);
+            dup2(out[1], 2);
+        }
+        execvp(sh->argv[0], sh->argv);
+        _exit(127);
+    }
+
+    // The parent keeps the slave side open while the shell runs, otherwise reading the master
+    // fails until the shell has opened its own.
+    if (!use_pty) {
+        close(in[0]);
+        close(out[1]);
+    }
+    return 0;
+}
+
+
+/* Sends text to the shell. */
+int session_send(struct session *s, const char *text) {
+    size_t len = strlen(text), sent = 0;
+    while (sent < len) {
+        ssize_t n = write(s->in, text + sent, len - sent);
+        if (n < 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+
+/* Reads the shell's output until a line holding text shows up, and drops everything up to the
+   end of that line. The rest of the line after text is copied to rest. Returns 0, or -1 if the
+   shell went away or didn't answer in time. */
+int session_wait(struct session *s, const char *text, char rest[], int rest_size) {
+    long long deadline = now_ns() + REPLY_TIMEOUT_MS * 1000000LL;
+    int text_len = strlen(text);
+
+    while (1) {
+        // Looks for text followed by the end of its line in what's been read so far.
+        char *found = memmem(s->buffer, s->len, text, text_len);
+        if (found != NULL) {
+            char *end = memchr(found, '\n', s->buffer + s->len - found);
+            if (end != NULL) {
+                if (rest != NULL) {
+                    int n = end - (found + text_len);
+                    n = n < rest_size - 1 ? n : rest_size - 1;
+                    memcpy(rest, found + text_len, n);
+                    rest[n] = '\0';
+                }
+                end++;
+                s->len -= end - s->buffer;
+                memmove(s->buffer, end, s->len);
+                return 0;
+            }
+        }
+
+        // Keeps only the tail of the output if it fills up without a match.
+        if (s->len > (int) sizeof(s->buffer) / 2) {
+            memmove(s->buffer, s->buffer + s->len - 1024, 1024);
+            s->len = 1024;
+        }
+
+        long long left = (deadline - now_ns()) / 1000000;
+        struct pollfd p = { s->out, POLLIN, 0 };
+        if (left <= 0 || poll(&p, 1, left) <= 0) {
+            return -1;
+        }
+        ssize_t n = read(s->out, s->buffer + s->len, sizeof(s->buffer) - s->len);
+        if (n <= 0) {
+            return -1;
+        }
+        s->len += n;
+    }
+}
+
+
+/* Sends a line and waits for its reply, returns how long that took in nanoseconds or -1. */
+long long round_trip(struct session *s, const char *line, const char *reply) {
+    long long start = now_ns();
+    if (session_send(s, line) < 0 || session_wait(s, reply, NULL, 0) < 0) {
+        return -1;
+    }
+    return now_ns() - start;
+}
+
+
+/* Starts a background sleep and returns its pid, or -1. */
+pid_t start_background(struct session *s, const char *seconds) {
+    char line[128], rest[64];
+    snprintf(line, sizeof(line), s->sh->background, seconds);
+    if (session_send(s, line) < 0 || session_wait(s, s->sh->background_pid, rest, sizeof(rest)) < 0) {
+        return -1;
+    }
+    return atoi(rest);
+}
+
+
+/* Gets the state letter of a process from /proc, or 0 once the process is gone. */
+char process_state(pid_t pid) {
+    char path[64], stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    stat[n] = '\0';
+
+    // The state comes after the command name, which is in parentheses and may hold spaces.
+    char *paren = strrchr(stat, ')');
+    return (paren != NULL && paren[1] == ' ') ? paren[2] : '?';
+}
+
+
+/* Kills every process in a session. Job control puts background jobs of an interactive shell in
+   process groups of their own, so killing the shell's group alone would leave them running. */
+void kill_session(pid_t sid) {
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    while (proc != NULL && (entry = readdir(proc)) != NULL) {
+        char path[300], stat[512];
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t n = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        stat[n > 0 ? n : 0] = '\0';
+
+        // After the command name come the state, parent, process group and session.
+        char *paren = strrchr(stat, ')');
+        int session;
+        if (paren != NULL && sscanf(paren + 2, "%*c %*d %*d %d", &session) == 1 && session == sid) {
+            kill(atoi(entry->d_name), SIGKILL);
+        }
+    }
+    if (proc != NULL) {
+        closedir(proc);
+    }
+}
+
+
+/* Watches a background job finish. Returns the nanoseconds from it exiting to the shell reaping it,
+   or -1 if it wasn't reaped within REAP_TIMEOUT_MS of exiting. */
+long long reap_latency(pid_t pid) {
+    struct timespec pause = { 0, 20000 };
+    long long exited = -1;
+
+    while (1) {
+        char state = process_state(pid);
+        long long now = now_ns();
+        if (state == 0) {
+            // Gone before it was seen as a zombie, so it was reaped within one poll.
+            return exited < 0 ? 0 : now - exited;
+        }
+        if (state == 'Z' && exited < 0) {
+            exited = now;
+        }
+        if (exited >= 0 && now - exited > REAP_TIMEOUT_MS * 1000000LL) {
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+/* Looks up a shell named on the command line. A path ending in one of the names runs that
+   program with the named shell's commands. Returns 0, or -1 for an unknown name. */
+int find_shell(const char *arg, struct shell *sh) {
+    const char *base = strrchr(arg, '/') != NULL ? strrchr(arg, '/') + 1 : arg;
+    for (int i = 0; i < (int) (sizeof(shells) / sizeof(shells[0])); i++) {
+        if (strcmp(base, shells[i].name) == 0) {
+            *sh = shells[i];
+            if (strchr(arg, '/') != NULL) {
+                sh->argv[0] = (char *) arg;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/* Orders samples for qsort(). */
+int compare(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Value below which the given fraction of the sorted samples fall, in microseconds. */
+double percentile(long long samples[], int count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    int i = (int) (fraction * (count - 1) + 0.5);
+    return samples[i] / 1e3;
+}
+
+
+/* Runs every measurement on one shell with jobs idle background jobs. Returns 0, or -1 if the
+   shell stopped answering. */
+int run(struct shell *sh, int jobs, FILE *results) {
+    struct session s;
+    // -r 0 leaves out the reaping test, reaps still gets a slot so the array isn't empty.
+    long long rtt[rounds], exec[rounds], reaps[reap_samples > 0 ? reap_samples : 1];
+    int reaped = 0, unreaped = 0;
+
+    if (session_start(&s, sh) < 0) {
+        return -1;
+    }
+
+    // The first reply also shows the shell started.
+    int ok = round_trip(&s, sh->builtin, sh->builtin_reply) >= 0;
+
+    // Idle jobs that stay around for the whole run.
+    for (int i = 0; ok && i < jobs; i++) {
+        ok = start_background(&s, "1000") > 0;
+    }
+
+    // Round trip of a builtin, then of an external command.
+    for (int i = 0; ok && i < rounds; i++) {
+        ok = (rtt[i] = round_trip(&s, sh->builtin, sh->builtin_reply)) >= 0;
+    }
+    for (int i = 0; ok && i < rounds; i++) {
+        ok = (exec[i] = round_trip(&s, "/bin/echo BENCH\n", "BENCH")) >= 0;
+    }
+
+    // A batch of commands written at once, timed until the builtin after them is answered.
+    double per_second = 0;
+    if (ok) {
+        long long start = now_ns();
+        for (int i = 0; ok && i < batch; i++) {
+            ok = session_send(&s, "/bin/true\n") == 0;
+        }
+        ok = ok && round_trip(&s, sh->builtin, sh->builtin_reply) >= 0;
+        per_second = (batch + 1) / ((now_ns() - start) / 1e9);
+    }
+
+    // Short background jobs, each watched until it's reaped. A builtin afterwards lets a shell
+    // that only reaps between commands catch up before the next one.
+    for (int i = 0; ok && i < reap_samples; i++) {
+        pid_t pid = start_background(&s, REAP_SLEEP);
+        ok = pid > 0;
+        if (ok) {
+            long long latency = reap_latency(pid);
+            if (latency < 0) {
+                unreaped++;
+            } else {
+                reaps[reaped++] = latency;
+            }
+            ok = round_trip(&s, sh->builtin, sh->builtin_reply) >= 0;
+        }
+    }
+
+    // Done, everything the shell started goes with it.
+    session_send(&s, "exit\n");
+    usleep(10000);
+    kill_session(s.pid);
+    waitpid(s.pid, NULL, 0);
+    close(s.in);
+    if (s.out != s.in) {
+        close(s.out);
+    }
+    if (s.slave >= 0) {
+        close(s.slave);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "BENCH: %s stopped answering (jobs %d)\n", sh->name, jobs);
+        return -1;
+    }
+
+    qsort(rtt, rounds, sizeof(long long), compare);
+    qsort(exec, rounds, sizeof(long long), compare);
+    qsort(reaps, reaped, sizeof(long long), compare);
+    double fork_exec = percentile(exec, rounds, 0.5) - percentile(rtt, rounds, 0.5);
+
+    printf("%-8s %5d %8.1f %8.1f %8.1f %8.1f %9.1f %9.0f %8.1f %8.1f %6d\n", sh->name, jobs,
+           percentile(rtt, rounds, 0.5), percentile(rtt, rounds, 0.99),
+           percentile(exec, rounds, 0.5), percentile(exec, rounds, 0.99), fork_exec, per_second,
+           percentile(reaps, reaped, 0.5), percentile(reaps, reaped, 0.99), unreaped);
+    fflush(stdout);
+
+    if (results != NULL) {
+        fprintf(results, "%s,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%.3f,%.3f,%d\n", sh->name,
+                use_pty ? "pty" : "pipe", jobs, percentile(rtt, rounds, 0.5), percentile(rtt, rounds, 0.99),
+                percentile(exec, rounds, 0.5), percentile(exec, rounds, 0.99), fork_exec, per_second,
+                percentile(reaps, reaped, 0.5), percentile(reaps, reaped, 0.99), unreaped);
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *usage = "USAGE: %s [-p] [-n rounds] [-b batch] [-r reap_samples] [-j jobs,jobs...] "
+                        "[-o results.csv] [smallsh|dash|bash ...]\n";
+    const char *job_list = "0,100";
+    const char *results_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "pn:b:r:j:o:")) != -1) {
+        switch (opt) {
+        case 'p':
+            use_pty = 1;
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'r':
+            reap_samples = atoi(optarg);
+            break;
+        case 'j':
+            job_list = optarg;
+            break;
+        case 'o':
+            results_path = optarg;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(1);
+        }
+    }
+    if (rounds < 1 || batch < 0 || reap_samples < 0) {
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+
+    // A shell that dies shows up as a failed write, not a crash.
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *results = NULL;
+    if (results_path != NULL) {
+        results = fopen(results_path, "w");
+        if (results == NULL) {
+            fprintf(stderr, "BENCH: ERROR opening %s\n", results_path);
+            exit(1);
+        }
+        fprintf(results, "shell,input,jobs,rtt_p50_us,rtt_p99_us,exec_p50_us,exec_p99_us,"
+                         "fork_exec_us,commands_per_s,reap_p50_us,reap_p99_us,unreaped\n");
+    }
+
+    printf("input: %s, latencies in microseconds\n", use_pty ? "pty" : "pipe");
+    printf("%-8s %5s %8s %8s %8s %8s %9s %9s %8s %8s %6s\n", "shell", "jobs", "rtt p50", "rtt p99",
+           "exec p50", "exec p99", "fork+exec", "cmds/s", "reap p50", "reap p99", "unreap");
+
+    // Every shell by default, otherwise the ones named.
+    int count = sizeof(shells) / sizeof(shells[0]), named = argc - optind, failed = 0;
+    for (int i = 0; i < (named > 0 ? named : count); i++) {
+        struct shell sh = shells[i % count];
+        if (named > 0 && find_shell(argv[optind + i], &sh) < 0) {
+            fprintf(stderr, "BENCH: unknown shell %s\n", argv[optind + i]);
+            failed = 1;
+            continue;
+        }
+
+        // One run per job count.
+        const char *jobs = job_list;
+        while (*jobs != '\0') {
+            if (run(&sh, atoi(jobs), results) < 0) {
+                failed = 1;
+            }
+            jobs += strcspn(jobs, ",");
+            jobs += (*jobs == ',');
+        }
+    }
+
+    if (results != NULL) {
+        fclose(results);
+    }
+    return failed;
+}
\ No newline at end of file
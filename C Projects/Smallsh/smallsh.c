@@ -1,16 +1,30 @@
 /* DESCRIPTION: A project that implements a working version of a UNIX Shell. Not quite the same as UNIX or LINUX in terms of usability.
 *
 * NOTABLE IMPLEMENTATIONS: 
-* - Built in Commands: exit, status, cd.
+* - Built in Commands: exit, status, cd, hash, jobs, wait, parallel, stats, export, unset.
+* - "limit -t secs -v size -n files command" starts a command with rlimits, and with -c percent
+*   and -m size puts it in a cgroup of its own under $SMALLSH_CGROUP with cpu.max and memory.max.
+* - "time command" reports the CPU time, peak memory and context switches a command used, and
+*   $SMALLSH_TRACE names a file every command's start and finish are added to.
+* - echo, true, false, test/[, pwd, printf and kill also run in the shell, without starting a process.
+* - xargs runs in the shell too, packing as many items as fit in ARG_MAX into every command it starts.
 * - Other commands: Forked child processes.
-* - "$$" is expanded to be the working pid of the shell whenever it's presented.
+* - "$$" is expanded to be the working pid of the shell whenever it's presented, except inside '...'.
+* - "$?", "$!", "$NAME" and "${NAME}" are expanded too, and NAME=value sets a shell variable.
+* - "$(command)" is replaced by the command's output, read back through a pipe.
+* - "*", "?" and "[...]" in an argument are expanded to the sorted names of the files they match.
 * - & at the end of a command line tells the program to run it as a background process.
+* - $SMALLSH_CAPTURE keeps the last bytes background jobs write in memory, for "jobs -o %N".
 * - Customized CTRL^C and CTRL^Z signals. Because of this, type in "exit", if you need to exit the program.
-* - Supports commands lengths of 2048 characters and up to 512 arguments.
-* - Can run up to 1000 child processes before needing to restart the program.
+* - Command lines of any length, split up in one pass with '...' and "..." quoting and \ escapes.
+* - Background processes are kept in a job table that grows as needed, and are reported as soon as they finish.
+* - "smallsh script" and "smallsh -c command" run commands from a file or a string without a prompt, and exit
+*   with the status of the last command.
  */
 
 
+// pipe2() and W_EXITCODE().
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,332 +33,4109 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <dirent.h>
 
 
 // Flag used with CTRL^Z, when 1 is active, background commands are allowed.
 int bgIgnore = 1;
 
+// The environment passed on to commands.
+extern char **environ;
+
+
+/* What a command used: CPU time, peak memory and context switches from wait4(), added up over the
+   processes of a pipeline, and how long it ran. */
+struct usage {
+    long long startNS, wallNS;
+    long long userUS, sysUS;
+    // The largest peak of any one of the processes, in KB.
+    long maxRSS;
+    long voluntary, involuntary;
+};
+
+
+/* A background process the shell hasn't reaped yet. A background pipeline is one job made of
+   several processes, its first process (the leader) keeps track of the job as a whole. */
+struct job {
+    // 0 for an empty slot, -1 for a slot whose job was removed.
+    pid_t pid;
+    // The pipeline's first process, which is also its process group. The same as pid for the leader.
+    pid_t leader;
+    // 1 once the process has been reaped, only the leader is kept after that.
+    int done;
+    // Leader only: processes still running, the last process and its exit status.
+    int running;
+    pid_t last;
+    int status;
+    // Leader only: the job number used by "%N" and the command line, for the jobs command.
+    int id;
+    char *command;
+    // 1 for a command started by the parallel command, which is reaped but not reported, parallel
+    // picks up its status from here.
+    int task;
+    // Leader only: what the job's finished processes have used, and 1 if it was started with
+    // "time", to report that when it's done.
+    struct usage usage;
+    int timed;
+    // Leader only: the cgroup the job was put in by "limit", removed when the job is done.
+    char *cgroup;
+};
+
+/* The background processes, in a hash table keyed by pid so adding and removing one doesn't
+   depend on how many there are. The table doubles in size when it gets half full. */
+struct jobTable {
+    struct job *slots;
+    // Number of slots (a power of 2), jobs in the table, and removed slots not reused yet.
+    int size, count, removed;
+    // Number the next job gets, back to 1 whenever the table empties.
+    int nextId;
+};
+
+struct jobTable jobs = { NULL, 0, 0, 0, 1 };
+
+// signalfd() that SIGCHLD is read from, so finished children are noticed while waiting for input.
+int childFD = -1;
+
+
+/* Slot a pid starts looking from in a table of the given size. */
+int jobHash(pid_t pid, int size) {
+    return (int) (((unsigned int) pid * 2654435761u) & (size - 1));
+}
+
+
+/* Finds the slot holding a pid, or -1 if it isn't in the table. */
+int jobFind(pid_t pid) {
+    if (jobs.size == 0) {
+        return -1;
+    }
+
+    // Linear probing, an empty slot ends the search but a removed one doesn't.
+    int i = jobHash(pid, jobs.size);
+    while (jobs.slots[i].pid != 0) {
+        if (jobs.slots[i].pid == pid) {
+            return i;
+        }
+        i = (i + 1) & (jobs.size - 1);
+    }
+    return -1;
+}
+
+
+/* Adds a background process to the job table, leader is the first process of its pipeline. */
+void jobAdd(pid_t pid, pid_t leader) {
+    struct job entry = { pid, leader, 0, 0, 0, 0, 0, NULL, 0, { 0 }, 0, NULL };
+
+    // Grows the table (or just clears out removed slots) once it's half used.
+    if ((jobs.count + jobs.removed + 1) * 2 > jobs.size) {
+        struct jobTable old = jobs;
+        jobs.size = (jobs.size == 0) ? 64 : ((jobs.count + 1) * 4 > jobs.size ? jobs.size * 2 : jobs.size);
+        jobs.slots = calloc(jobs.size, sizeof(struct job));
+        jobs.count = 0;
+        jobs.removed = 0;
+        if (jobs.slots == NULL) {
+            perror("calloc()");
+            exit(1);
+        }
+
+        int i;
+        for (i = 0; i < old.size; i++) {
+            if (old.slots[i].pid > 0) {
+                jobAdd(old.slots[i].pid, old.slots[i].leader);
+                jobs.slots[jobFind(old.slots[i].pid)] = old.slots[i];
+            }
+        }
+        free(old.slots);
+    }
+
+    int i = jobHash(pid, jobs.size);
+    while (jobs.slots[i].pid > 0) {
+        i = (i + 1) & (jobs.size - 1);
+    }
+    if (jobs.slots[i].pid < 0) {
+        jobs.removed--;
+    }
+    jobs.slots[i] = entry;
+    jobs.count++;
+}
+
+
+/* Removes a process from the job table. Returns 1 if it was there. */
+int jobRemove(pid_t pid) {
+    int i = jobFind(pid);
+    if (i < 0) {
+        return 0;
+    }
+    jobs.slots[i].pid = -1;
+    free(jobs.slots[i].command);
+    jobs.slots[i].command = NULL;
+    if (jobs.slots[i].cgroup != NULL) {
+        rmdir(jobs.slots[i].cgroup);
+        free(jobs.slots[i].cgroup);
+        jobs.slots[i].cgroup = NULL;
+    }
+    jobs.count--;
+    jobs.removed++;
+    return 1;
+}
+
+
+/* A shell variable, kept as one "NAME=value" string so an exported one can go straight into the
+   environment passed to commands. */
+struct variable {
+    // NULL for an empty slot.
+    char *entry;
+    int nameLen;
+    // 1 if it's passed on to commands.
+    int exported;
+};
+
+/* The shell's variables, in a hash table keyed by name like the command table, so a "$NAME" is
+   found without scanning the environment. It starts out as a copy of the environment the shell
+   was given. The environment commands get is made from the exported variables again only after
+   one of them changes, and until then the old one stays in environ, with the strings it points
+   at that were replaced kept in retired so they're still there. */
+struct variableTable {
+    struct variable *slots;
+    // Number of slots (a power of 2) and variables in the table.
+    int size, count;
+    // 1 when the environment no longer matches the exported variables.
+    int changed;
+    char **environment;
+    char **retired;
+    int retiredCount, retiredSize;
+};
+
+struct variableTable variables = { NULL, 0, 0, 0, NULL, NULL, 0, 0 };
+
+
+/* Slot a variable name of len chars starts looking from (FNV-1a). */
+int variableHash(const char *name, size_t len, int size) {
+    unsigned int hash = 2166136261u;
+    while (len-- > 0) {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return (int) (hash & (size - 1));
+}
+
+
+/* Finds the slot holding a variable, or the empty slot it would go in. */
+int variableFind(const char *name, size_t len) {
+    int i = variableHash(name, len, variables.size);
+    while (variables.slots[i].entry != NULL &&
+           (variables.slots[i].nameLen != len || memcmp(variables.slots[i].entry, name, len) != 0)) {
+        i = (i + 1) & (variables.size - 1);
+    }
+    return i;
+}
+
+
+/* The value of the variable with the len chars at name as its name, or NULL if it isn't set. */
+const char* variableGet(const char *name, size_t len) {
+    if (variables.size == 0) {
+        return NULL;
+    }
+    struct variable *v = &variables.slots[variableFind(name, len)];
+    return (v->entry != NULL) ? v->entry + v->nameLen + 1 : NULL;
+}
+
+
+/* Puts a string the environment may still point at aside, to be freed once it's made again. */
+void variableRetire(char *entry) {
+    if (variables.retiredCount == variables.retiredSize) {
+        variables.retiredSize = (variables.retiredSize == 0) ? 16 : variables.retiredSize * 2;
+        variables.retired = realloc(variables.retired, variables.retiredSize * sizeof(char*));
+        if (variables.retired == NULL) {
+            perror("realloc()");
+            exit(1);
+        }
+    }
+    variables.retired[variables.retiredCount++] = entry;
+}
+
+
+/* Sets a variable from a "NAME=value" string, nameLen being where the "=" is. export 1 passes it
+   on to commands, 0 keeps it the way it was (not passed on for a new one). */
+void variableSet(const char *assignment, size_t nameLen, int export) {
+
+    // Grows the table once it's half full.
+    if ((variables.count + 1) * 2 > variables.size) {
+        struct variableTable old = variables;
+        variables.size = (variables.size == 0) ? 128 : variables.size * 2;
+        variables.slots = calloc(variables.size, sizeof(struct variable));
+        if (variables.slots == NULL) {
+            perror("calloc()");
+            exit(1);
+        }
+
+        int i;
+        for (i = 0; i < old.size; i++) {
+            if (old.slots[i].entry != NULL) {
+                variables.slots[variableFind(old.slots[i].entry, old.slots[i].nameLen)] = old.slots[i];
+            }
+        }
+        free(old.slots);
+    }
+
+    struct variable *v = &variables.slots[variableFind(assignment, nameLen)];
+    int exported = export || (v->entry != NULL && v->exported);
+    if (v->entry == NULL) {
+        variables.count++;
+    } else if (v->exported) {
+        variableRetire(v->entry);
+    } else {
+        free(v->entry);
+    }
+
+    v->entry = strdup(assignment);
+    if (v->entry == NULL) {
+        perror("strdup()");
+        exit(1);
+    }
+    v->nameLen = nameLen;
+    v->exported = exported;
+    variables.changed |= exported;
+}
+
+
+/* Removes the variable with the len chars at name as its name. Everything after it up to the
+   next empty slot is put back in, so the probing doesn't stop early. */
+void variableUnset(const char *name, size_t len) {
+    if (variables.size == 0) {
+        return;
+    }
+    int i = variableFind(name, len);
+    if (variables.slots[i].entry == NULL) {
+        return;
+    }
+    if (variables.slots[i].exported) {
+        variableRetire(variables.slots[i].entry);
+        variables.changed = 1;
+    } else {
+        free(variables.slots[i].entry);
+    }
+    variables.slots[i].entry = NULL;
+    variables.count--;
+
+    i = (i + 1) & (variables.size - 1);
+    while (variables.slots[i].entry != NULL) {
+        struct variable moved = variables.slots[i];
+        variables.slots[i].entry = NULL;
+        variables.slots[variableFind(moved.entry, moved.nameLen)] = moved;
+        i = (i + 1) & (variables.size - 1);
+    }
+}
+
+
+/* Sets a variable back to how it was before an assignment in front of a command: saved is a
+   copy of its "NAME=value" string, or NULL if it wasn't set. */
+void variableRestore(const char *name, size_t len, char *saved, int exported) {
+    if (saved == NULL) {
+        variableUnset(name, len);
+        return;
+    }
+    variableSet(saved, len, 0);
+    variables.slots[variableFind(name, len)].exported = exported;
+    variables.changed = 1;
+    free(saved);
+}
+
+
+/* Length of the name at the start of s if it's "NAME=...", 0 if it isn't an assignment. */
+size_t assignmentName(const char *s) {
+    size_t len = 0;
+    if (!isalpha((unsigned char) s[0]) && s[0] != '_') {
+        return 0;
+    }
+    while (isalnum((unsigned char) s[len]) || s[len] == '_') {
+        len++;
+    }
+    return (s[len] == '=') ? len : 0;
+}
+
+
+/* Fills the table from the environment the shell was started with, all of it exported. */
+void variablesInit() {
+    int i;
+    for (i = 0; environ[i] != NULL; i++) {
+        size_t len = assignmentName(environ[i]);
+        if (len > 0) {
+            variableSet(environ[i], len, 1);
+        }
+    }
+    variables.changed = 0;
+}
+
+
+/* Makes environ match the exported variables, if any of them changed since it was last made.
+   Called before starting a command, so a line that doesn't change an exported variable costs
+   nothing here. */
+void variablesExport() {
+    if (!variables.changed) {
+        return;
+    }
+
+    int i, n = 0;
+    free(variables.environment);
+    variables.environment = malloc((variables.count + 1) * sizeof(char*));
+    if (variables.environment == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    for (i = 0; i < variables.size; i++) {
+        if (variables.slots[i].entry != NULL && variables.slots[i].exported) {
+            variables.environment[n++] = variables.slots[i].entry;
+        }
+    }
+    variables.environment[n] = NULL;
+    environ = variables.environment;
+
+    // Nothing points at the replaced strings anymore.
+    for (i = 0; i < variables.retiredCount; i++) {
+        free(variables.retired[i]);
+    }
+    variables.retiredCount = 0;
+    variables.changed = 0;
+}
+
+
+/* Built in export: "export NAME=value" sets a variable and passes it on to commands, "export
+   NAME" passes on one that's already set, and just "export" lists the ones passed on. */
+int exportCMD(char *args[], int lastStatus) {
+    int i, result = 0;
+    if (args[1] == NULL) {
+        variablesExport();
+        for (i = 0; environ[i] != NULL; i++) {
+            printf("export %s\n", environ[i]);
+        }
+        return 0;
+    }
+
+    for (i = 1; args[i] != NULL; i++) {
+        size_t len = assignmentName(args[i]);
+        if (len > 0) {
+            variableSet(args[i], len, 1);
+        } else if (isalpha((unsigned char) args[i][0]) || args[i][0] == '_') {
+            const char *value = variableGet(args[i], strlen(args[i]));
+            if (value != NULL) {
+                char *entry = malloc(strlen(args[i]) + strlen(value) + 2);
+                if (entry == NULL) {
+                    perror("malloc()");
+                    exit(1);
+                }
+                sprintf(entry, "%s=%s", args[i], value);
+                variableSet(entry, strlen(args[i]), 1);
+                free(entry);
+            }
+        } else {
+            fprintf(stderr, "export: %s: bad variable name\n", args[i]);
+            result = 1;
+        }
+    }
+    return result;
+}
+
+
+/* Built in unset, removes variables. */
+int unsetCMD(char *args[], int lastStatus) {
+    int i;
+    for (i = 1; args[i] != NULL; i++) {
+        variableUnset(args[i], strlen(args[i]));
+    }
+    return 0;
+}
+
+
+/* A command name found on the PATH, and where. */
+struct command {
+    // NULL for an empty slot.
+    char *name;
+    char *path;
+    // How many times the cached path has been used, shown by the hash command.
+    int hits;
+};
+
+/* Commands already looked up, in a hash table keyed by name, so a command is searched for on the
+   PATH once instead of execvp() trying every directory for every command. Entries are only ever
+   removed all at once, so the table doesn't need removed slots like the job table. */
+struct commandTable {
+    struct command *slots;
+    // Number of slots (a power of 2) and commands in the table.
+    int size, count;
+    // The PATH the table was filled from, the table is cleared when it changes.
+    char *searchPath;
+};
+
+struct commandTable commands = { NULL, 0, 0, NULL };
+
+
+/* Slot a command name starts looking from (FNV-1a). */
+int commandHash(const char *name, int size) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return (int) (hash & (size - 1));
+}
+
+
+/* Finds the slot holding a command, or the empty slot it would go in. */
+int commandFind(const char *name) {
+    int i = commandHash(name, commands.size);
+    while (commands.slots[i].name != NULL && strcmp(commands.slots[i].name, name) != 0) {
+        i = (i + 1) & (commands.size - 1);
+    }
+    return i;
+}
+
+
+/* Empties the command table, used by "hash -r" and when the PATH changes. */
+void commandClear() {
+    int i;
+    for (i = 0; i < commands.size; i++) {
+        if (commands.slots[i].name != NULL) {
+            free(commands.slots[i].name);
+            free(commands.slots[i].path);
+            commands.slots[i].name = NULL;
+        }
+    }
+    commands.count = 0;
+}
+
+
+/* Adds a command and its path to the table. */
+void commandAdd(const char *name, const char *path) {
+
+    // Grows the table once it's half full.
+    if ((commands.count + 1) * 2 > commands.size) {
+        struct commandTable old = commands;
+        commands.size = (commands.size == 0) ? 64 : commands.size * 2;
+        commands.slots = calloc(commands.size, sizeof(struct command));
+        if (commands.slots == NULL) {
+            perror("calloc()");
+            exit(1);
+        }
+
+        int i;
+        for (i = 0; i < old.size; i++) {
+            if (old.slots[i].name != NULL) {
+                commands.slots[commandFind(old.slots[i].name)] = old.slots[i];
+            }
+        }
+        free(old.slots);
+    }
+
+    int i = commandFind(name);
+    commands.slots[i].name = strdup(name);
+    commands.slots[i].path = strdup(path);
+    commands.slots[i].hits = 0;
+    commands.count++;
+}
+
+
+/* Removes one command from the table, after its cached path failed to run. Everything after it
+   up to the next empty slot is put back in, so the probing doesn't stop early. */
+void commandRemove(const char *name) {
+    if (commands.size == 0) {
+        return;
+    }
+    int i = commandFind(name);
+    if (commands.slots[i].name == NULL) {
+        return;
+    }
+    free(commands.slots[i].name);
+    free(commands.slots[i].path);
+    commands.slots[i].name = NULL;
+    commands.count--;
+
+    i = (i + 1) & (commands.size - 1);
+    while (commands.slots[i].name != NULL) {
+        struct command moved = commands.slots[i];
+        commands.slots[i].name = NULL;
+        commands.slots[commandFind(moved.name)] = moved;
+        i = (i + 1) & (commands.size - 1);
+    }
+}
+
+
+/* Finds the full path of a command. Names with a "/" are used as they are. Others are looked up
+   in the table, and searched for on the PATH the first time, the same way execvp() does (with
+   "/bin:/usr/bin" when there's no PATH). Returns NULL if it isn't on the PATH. */
+const char* commandPath(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    // A different PATH can find different programs, so nothing found with the old one is kept.
+    const char *searchPath = variableGet("PATH", 4);
+    if (searchPath == NULL) {
+        searchPath = "/bin:/usr/bin";
+    }
+    if (commands.searchPath == NULL || strcmp(commands.searchPath, searchPath) != 0) {
+        commandClear();
+        free(commands.searchPath);
+        commands.searchPath = strdup(searchPath);
+    }
+
+    if (commands.size > 0) {
+        int i = commandFind(name);
+        if (commands.slots[i].name != NULL) {
+            commands.slots[i].hits++;
+            return commands.slots[i].path;
+        }
+    }
+
+    // The first regular file with an execute bit in a PATH directory, an empty one being the
+    // current directory.
+    const char *dir = searchPath;
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        char path[4096];
+        int len = snprintf(path, sizeof(path), "%.*s%s%s", (int) (end - dir), dir, end == dir ? "" : "/", name);
+        struct stat st;
+        if (len < sizeof(path) && stat(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            commandAdd(name, path);
+            commands.slots[commandFind(name)].hits = 1;
+            return commands.slots[commandFind(name)].path;
+        }
+        if (*end == '\0') {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+
+/* Built in command, "hash" lists the commands found so far and how many times each was run,
+   "hash -r" forgets them all and "hash name..." looks the names up now. */
+int hashCMD(char *args[], int lastStatus) {
+    int result = 0;
+    if (args[1] == NULL) {
+        if (commands.count == 0) {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        int i;
+        for (i = 0; i < commands.size; i++) {
+            if (commands.slots[i].name != NULL) {
+                printf("%4d\t%s\n", commands.slots[i].hits, commands.slots[i].path);
+            }
+        }
+        return 0;
+    }
+
+    int i;
+    for (i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            commandClear();
+        } else if (strchr(args[i], '/') == NULL) {
+            // Looked up again from the PATH, like bash does.
+            commandRemove(args[i]);
+            if (commandPath(args[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                result = 1;
+            } else {
+                commands.slots[commandFind(args[i])].hits = 0;
+            }
+        }
+    }
+    return result;
+}
+
 
 /* Built in command, changes the directory. */
-void cd(char* line) {
+int cd(char *args[], int lastStatus) {
+
+    // Just "cd" changes the directory to the home environment, otherwise the second argument is the desired path.
+    const char *newPath = args[1];
+    if (newPath == NULL) {
+        newPath = variableGet("HOME", 4);
+        if (newPath == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    }
+
+    if (chdir(newPath) < 0) {
+        perror("chdir()");
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Built in command, prints the exit status or termination signal of the last
+   foreground process ran, used/modified from lectures.*/
+void status(int status) {
+
+    // Exited normally.
+    if (WIFEXITED(status)) {
+        printf("exit value %d\n", WEXITSTATUS(status));
+
+    // Exited via signal.
+    } else {
+        printf("terminated by signal %d\n", WTERMSIG(status));
+    }
+}
+
+
+/* A status as the exit value sh would give it: the value the process exited with, or 128 + the
+   signal that killed it. */
+int exitValue(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+
+/* Current time in nanoseconds, for how long commands run. */
+long long nowNS() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/* Adds what one process used, as wait4() gives it, to a command's usage. */
+void usageAdd(struct usage *u, const struct rusage *r) {
+    u->userUS += r->ru_utime.tv_sec * 1000000LL + r->ru_utime.tv_usec;
+    u->sysUS += r->ru_stime.tv_sec * 1000000LL + r->ru_stime.tv_usec;
+    if (r->ru_maxrss > u->maxRSS) {
+        u->maxRSS = r->ru_maxrss;
+    }
+    u->voluntary += r->ru_nvcsw;
+    u->involuntary += r->ru_nivcsw;
+}
+
+
+/* Adds what v used to u, the same way as usageAdd(). */
+void usageJoin(struct usage *u, const struct usage *v) {
+    u->userUS += v->userUS;
+    u->sysUS += v->sysUS;
+    if (v->maxRSS > u->maxRSS) {
+        u->maxRSS = v->maxRSS;
+    }
+    u->voluntary += v->voluntary;
+    u->involuntary += v->involuntary;
+}
+
+
+/* Prints what a command used to stderr, for "time". */
+void printUsage(const struct usage *u) {
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+            u->wallNS / 1e9, u->userUS / 1e6, u->sysUS / 1e6, u->maxRSS, u->voluntary, u->involuntary);
+}
+
+
+// How many finished commands the stats command shows.
+#define HISTORY_SIZE 32
+
+/* A finished command and what it used. */
+struct record {
+    pid_t pid;
+    int status;
+    struct usage usage;
+    char *command;
+};
+
+/* The last HISTORY_SIZE finished commands, the oldest overwritten first, and totals for every
+   command the shell has run. */
+struct history {
+    struct record records[HISTORY_SIZE];
+    int next, count;
+    long long wallNS, userUS, sysUS;
+    long maxRSS;
+};
+
+struct history history;
+
+/* The trace file named by $SMALLSH_TRACE, NULL without one. Every command started and finished
+   adds a line, with the fields separated by tabs:
+     time start pid command
+     time exit pid exit-value wall-seconds user-seconds sys-seconds maxrss-KB voluntary involuntary
+   time is seconds since the epoch, to the microsecond, and pid is the first process of a pipeline. */
+FILE *trace = NULL;
+
+
+/* Seconds since the epoch, for the trace file. */
+double traceTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/* Adds a command starting to the trace file. */
+void traceStart(pid_t pid, const char *command) {
+    if (trace != NULL) {
+        fprintf(trace, "%.6f\tstart\t%d\t%s\n", traceTime(), pid, command);
+    }
+}
+
+
+/* Keeps a finished command for the stats command and adds it to the trace file. The record
+   takes over command, which has to come from malloc(). */
+void recordCommand(pid_t pid, int status, const struct usage *u, char *command) {
+    if (trace != NULL) {
+        fprintf(trace, "%.6f\texit\t%d\t%d\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\n", traceTime(), pid, exitValue(status),
+                u->wallNS / 1e9, u->userUS / 1e6, u->sysUS / 1e6, u->maxRSS, u->voluntary, u->involuntary);
+    }
+
+    struct record *r = &history.records[history.next];
+    free(r->command);
+    r->pid = pid;
+    r->status = status;
+    r->usage = *u;
+    r->command = command;
+    history.next = (history.next + 1) % HISTORY_SIZE;
+    history.count++;
+
+    history.wallNS += u->wallNS;
+    history.userUS += u->userUS;
+    history.sysUS += u->sysUS;
+    if (u->maxRSS > history.maxRSS) {
+        history.maxRSS = u->maxRSS;
+    }
+}
+
+
+// Finished jobs whose captured output is kept for "jobs -o", the oldest is dropped first.
+#define CAPTURE_KEEP 8
+// Most a capture reads in one go, so a job writing nonstop can't keep the shell from its prompt.
+#define CAPTURE_BURST (1 << 20)
+
+/* What a background job wrote to stdout and stderr when $SMALLSH_CAPTURE is set, read from a pipe
+   whenever the shell is waiting on something. Only the last size bytes are kept, in a ring, so a
+   job uses the same memory however much it writes. */
+struct capture {
+    // Read end of the pipe, -1 once every process of the job has closed its end.
+    int fd;
+    // The job's leader and number, kept once it's done for "jobs -o".
+    pid_t leader;
+    int id;
+    int done;
+    // The next byte goes at total % size, total counts every byte the job wrote.
+    char *ring;
+    size_t size;
+    long long total;
+};
+
+/* Every capture, oldest first: those of running jobs and of the last CAPTURE_KEEP finished ones. */
+struct captureList {
+    struct capture **list;
+    // Captures in the list, how many it has room for, and how many still have their pipe open.
+    int count, size, open;
+};
+
+struct captureList captures = { NULL, 0, 0, 0 };
+
+
+/* Reads what's waiting in a capture's pipe straight into its ring, up to CAPTURE_BURST bytes.
+   The pipe is closed at its end. */
+void captureRead(struct capture *c) {
+    long long start = c->total;
+    while (c->fd >= 0 && c->total - start < CAPTURE_BURST) {
+        size_t pos = c->total % c->size;
+        ssize_t n = read(c->fd, c->ring + pos, c->size - pos);
+        if (n > 0) {
+            c->total += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            close(c->fd);
+            c->fd = -1;
+            captures.open--;
+        }
+    }
+}
+
+
+/* Reads every capture's pipe that has something waiting. */
+void drainCaptures() {
+    int i;
+    for (i = 0; i < captures.count && captures.open > 0; i++) {
+        captureRead(captures.list[i]);
+    }
+}
+
+
+/* Adds the open capture pipes to fds after the n already there, fds has to have room for
+   captures.open more. Returns the new count. */
+int watchCaptures(struct pollfd fds[], int n) {
+    int i;
+    for (i = 0; i < captures.count; i++) {
+        if (captures.list[i]->fd >= 0) {
+            fds[n].fd = captures.list[i]->fd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+/* Adds a capture for the job led by leader, reading from fd (which it takes over), with a ring
+   of size bytes. */
+void captureAdd(pid_t leader, int id, int fd, size_t size) {
+    struct capture *c = malloc(sizeof(struct capture));
+    char *ring = malloc(size);
+    if (c == NULL || ring == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    *c = (struct capture) { fd, leader, id, 0, ring, size, 0 };
+
+    if (captures.count == captures.size) {
+        captures.size = (captures.size == 0) ? 16 : captures.size * 2;
+        captures.list = realloc(captures.list, captures.size * sizeof(struct capture*));
+        if (captures.list == NULL) {
+            perror("realloc()");
+            exit(1);
+        }
+    }
+    captures.list[captures.count++] = c;
+    captures.open++;
+}
+
+
+/* Marks the capture of a job that's done, reading what it wrote last. Once more than
+   CAPTURE_KEEP finished jobs have one, the oldest is freed. */
+void captureDone(pid_t leader) {
+    int i, finished = 0;
+    for (i = captures.count - 1; i >= 0; i--) {
+        if (captures.list[i]->leader == leader && !captures.list[i]->done) {
+            captureRead(captures.list[i]);
+            captures.list[i]->done = 1;
+            break;
+        }
+    }
+    if (i < 0) {
+        return;
+    }
+
+    for (i = 0; i < captures.count; i++) {
+        finished += captures.list[i]->done;
+    }
+    for (i = 0; i < captures.count && finished > CAPTURE_KEEP; i++) {
+        struct capture *c = captures.list[i];
+        if (!c->done) {
+            continue;
+        }
+        // Something the job left running may still have the pipe open, it gets EPIPE from now on.
+        if (c->fd >= 0) {
+            close(c->fd);
+            captures.open--;
+        }
+        free(c->ring);
+        free(c);
+        memmove(&captures.list[i], &captures.list[i + 1], (captures.count - i - 1) * sizeof(struct capture*));
+        captures.count--;
+        finished--;
+        i--;
+    }
+}
+
+
+// The job the wait command is waiting for, and its status once it's done.
+pid_t waitedLeader = 0;
+int waitedStatus = 0;
+
+/* Reaps every child that has finished and reports the background jobs that are now done.
+   Returns how many were reported. */
+int reapJobs() {
+    int childStatus, reported = 0;
+    pid_t pid;
+    struct rusage used;
+
+    // Clears the SIGCHLD signals waiting on the signalfd, the loop below picks up all the children.
+    struct signalfd_siginfo info;
+    while (read(childFD, &info, sizeof(info)) > 0);
+
+    while ((pid = wait4(-1, &childStatus, WNOHANG, &used)) > 0) {
+        int i = jobFind(pid);
+        if (i < 0) {
+            continue;
+        }
+
+        // A command started by parallel, which keeps track of it itself.
+        if (jobs.slots[i].task) {
+            jobs.slots[i].done = 1;
+            jobs.slots[i].status = childStatus;
+            usageAdd(&jobs.slots[i].usage, &used);
+            continue;
+        }
+
+        // The leader stays in the table until the whole pipeline is done.
+        pid_t leader = jobs.slots[i].leader;
+        if (pid == leader) {
+            jobs.slots[i].done = 1;
+        } else {
+            jobRemove(pid);
+        }
+
+        // A pipeline's status is the status of its last process, its usage all of them added up.
+        int l = jobFind(leader);
+        if (pid == jobs.slots[l].last) {
+            jobs.slots[l].status = childStatus;
+        }
+        usageAdd(&jobs.slots[l].usage, &used);
+
+        jobs.slots[l].running--;
+        if (jobs.slots[l].running == 0) {
+            // Prints child pid of the completed process.
+            printf("background pid %d is done: ", leader);
+            fflush(stdout);
+            // Calls the built-in status function to get the exit status.
+            status(jobs.slots[l].status);
+            if (leader == waitedLeader) {
+                waitedStatus = jobs.slots[l].status;
+            }
+
+            jobs.slots[l].usage.wallNS = nowNS() - jobs.slots[l].usage.startNS;
+            if (jobs.slots[l].timed) {
+                printUsage(&jobs.slots[l].usage);
+            }
+            recordCommand(leader, jobs.slots[l].status, &jobs.slots[l].usage, jobs.slots[l].command);
+            jobs.slots[l].command = NULL;
+            captureDone(leader);
+            jobRemove(leader);
+            reported++;
+        }
+    }
+    return reported;
+}
+
+
+// Input read from stdin that hasn't been handed out as a line yet.
+char inputBuffer[8192];
+int inputStart = 0, inputEnd = 0, inputDone = 0;
+
+/* Reads one line from stdin into *line, including the newline, growing *line (and *size with it)
+   as needed like getline(), so lines can be any length. While waiting for input it also watches
+   for finished background processes and reports them, printing the prompt again after. Returns
+   the length of the line, or -1 at the end of the input. */
+ssize_t readLine(char **line, size_t *size) {
+    size_t len = 0;
+    while (1) {
+        // Takes what's been read up to the newline, or all of it if there isn't one yet.
+        size_t avail = inputEnd - inputStart;
+        char *newline = memchr(inputBuffer + inputStart, '\n', avail);
+        size_t take = (newline != NULL) ? newline - (inputBuffer + inputStart) + 1 : avail;
+        if (len + take + 1 > *size) {
+            *size = (len + take + 1 > *size * 2) ? len + take + 1 : *size * 2;
+            *line = realloc(*line, *size);
+            if (*line == NULL) {
+                perror("realloc()");
+                exit(1);
+            }
+        }
+        memcpy(*line + len, inputBuffer + inputStart, take);
+        len += take;
+        inputStart += take;
+
+        // A whole line, or what's left at the end of the input.
+        if (newline != NULL || (inputDone && len > 0)) {
+            (*line)[len] = '\0';
+            return len;
+        }
+        if (inputDone) {
+            return -1;
+        }
+        inputStart = 0;
+        inputEnd = 0;
+
+        // Waits for input or a child to finish, reading captured output as it comes in. CTRL^Z
+        // interrupts the wait, which just starts over.
+        struct pollfd fds[2 + captures.open];
+        fds[0] = (struct pollfd) { 0, POLLIN, 0 };
+        fds[1] = (struct pollfd) { childFD, POLLIN, 0 };
+        if (poll(fds, watchCaptures(fds, 2), -1) < 0) {
+            continue;
+        }
+        drainCaptures();
+
+        if (fds[1].revents & POLLIN) {
+            if (reapJobs() > 0) {
+                printf(": ");
+                fflush(stdout);
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(0, inputBuffer, sizeof(inputBuffer));
+            if (n > 0) {
+                inputEnd = n;
+            } else if (n == 0 || errno != EINTR) {
+                inputDone = 1;
+            }
+        }
+    }
+}
+
+
+// The script run in script mode, all of it in memory, and how much of it has been read. NULL when
+// the commands come from stdin.
+const char *script = NULL;
+long scriptLen = 0, scriptPos = 0;
+
+/* Loads the script at path into memory with one mmap(), or with read() for something that can't
+   be mapped such as a pipe. */
+void loadScript(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        scriptLen = st.st_size;
+        if (scriptLen > 0) {
+            script = mmap(NULL, scriptLen, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (script == MAP_FAILED) {
+                perror(path);
+                exit(1);
+            }
+        } else {
+            script = "";
+        }
+
+    } else {
+        // Reads it all, doubling the buffer as it fills.
+        long size = 8192;
+        char *buffer = malloc(size);
+        ssize_t n;
+        while (buffer != NULL && (n = read(fd, buffer + scriptLen, size - scriptLen)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror(path);
+                exit(1);
+            }
+            scriptLen += n;
+            if (scriptLen == size) {
+                size *= 2;
+                buffer = realloc(buffer, size);
+            }
+        }
+        if (buffer == NULL) {
+            fprintf(stderr, "%s: out of memory\n", path);
+            exit(1);
+        }
+        script = buffer;
+    }
+    close(fd);
+}
+
+
+/* Hands out the next line of the script like readLine() does for stdin, pointing into the script
+   itself since the lexer doesn't change the line. There's nothing to wait for, finished background
+   processes are reported after each command instead. */
+ssize_t readScriptLine(const char **line) {
+    if (scriptPos >= scriptLen) {
+        return -1;
+    }
+
+    long len = scriptLen - scriptPos;
+    const char *newline = memchr(script + scriptPos, '\n', len);
+    if (newline != NULL) {
+        len = newline - (script + scriptPos) + 1;
+    }
+    *line = script + scriptPos;
+    scriptPos += len;
+    return len;
+}
+
+
+/* Built in command, exits the program and terminates the processes. Exits with 2 when
+   interactive, and with the last foreground status (128 + the signal if it was killed, like
+   sh) in script mode. */
+int exitCMD(char *args[], int lastStatus) {
+
+    int i;
+    for (i = 0; i < jobs.size; i++) {
+        // Kills every background process that hasn't finished yet.
+        if (jobs.slots[i].pid > 0 && !jobs.slots[i].done) {
+            kill(jobs.slots[i].pid, SIGKILL);
+        }
+    }
+
+    if (script == NULL) {
+        exit(2);
+    }
+    exit(exitValue(lastStatus));
+}
+
+
+/* Opens a redirection file in the shell, closed again when the command is started. The child gets
+   it through a dup2() file action, so a bad file is reported here without starting anything.
+   Returns the fd, or -1 after printing the error. */
+int openRedirect(const char *path, int flags, const char *what) {
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(what);
+    }
+    return fd;
+}
+
+
+/* Limits for the processes of one command, from the limit prefix. Any that's -1 isn't set. */
+struct limits {
+    // setrlimit() limits: CPU seconds, bytes of address space and open files.
+    long long cpuSeconds, addressSpace, files;
+    // cgroup v2 limits: percent of one CPU for cpu.max, and bytes for memory.max.
+    long long cpuPercent, memory;
+    // cgroup.procs of the command's cgroup, which the children write themselves into, or -1.
+    int procsFD;
+};
+
+
+/* Reads a size for limit: a number of bytes, or with K, M or G after it. Returns -1 if it isn't one. */
+long long limitSize(const char *s) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(s, &end, 10);
+    long long scale = 1;
+    switch (toupper((unsigned char) *end)) {
+    case 'G': scale <<= 10; // Falls through.
+    case 'M': scale <<= 10; // Falls through.
+    case 'K': scale <<= 10; end++; break;
+    }
+    if (errno != 0 || end == s || *end != '\0' || value < 0) {
+        return -1;
+    }
+    return value * scale;
+}
+
+
+/* Reads the options after "limit" into limits. Returns how many words they took up, or -1 after
+   printing the usage if one is wrong or there's no command after them. */
+int limitArgs(char *args[], struct limits *limits) {
+    struct limits none = { -1, -1, -1, -1, -1, -1 };
+    int i;
+    *limits = none;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        long long value = limitSize(args[i + 1]);
+        if (strcmp(args[i], "-t") == 0) {
+            limits->cpuSeconds = value;
+        } else if (strcmp(args[i], "-v") == 0) {
+            limits->addressSpace = value;
+        } else if (strcmp(args[i], "-n") == 0) {
+            limits->files = value;
+        } else if (strcmp(args[i], "-c") == 0) {
+            limits->cpuPercent = value;
+        } else if (strcmp(args[i], "-m") == 0) {
+            limits->memory = value;
+        } else {
+            value = -1;
+        }
+        if (value < 0) {
+            break;
+        }
+    }
+
+    if (args[i] == NULL || args[i][0] == '-') {
+        fprintf(stderr, "usage: limit [-t cpu_seconds] [-v address_space] [-n files] [-c cpu_percent] [-m memory] command\n");
+        return -1;
+    }
+    return i;
+}
+
+
+/* Writes value to a file in a cgroup's directory. Returns 0, or -1 after printing the error. */
+int cgroupWrite(const char *cgroup, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, value, strlen(value)) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+
+/* Puts a command in a cgroup of its own when it has cgroup limits, a directory made under
+   $SMALLSH_CGROUP (a cgroup v2 subtree delegated to the user) with cpu.max and memory.max set.
+   Returns the cgroup's path with its cgroup.procs opened into limits->procsFD, or NULL when
+   there's no cgroup to use. */
+char* cgroupCreate(struct limits *limits) {
+    static int count = 0, enabled = 0;
+    const char *root = variableGet("SMALLSH_CGROUP", 14);
+    char value[64];
+
+    if ((limits->cpuPercent < 0 && limits->memory < 0) || root == NULL || root[0] == '\0') {
+        return NULL;
+    }
+
+    // The leaves can only use the controllers their parent hands down, which happens once.
+    if (!enabled) {
+        cgroupWrite(root, "cgroup.subtree_control", "+cpu +memory");
+        enabled = 1;
+    }
+
+    char *cgroup = malloc(strlen(root) + 48);
+    if (cgroup == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    sprintf(cgroup, "%s/smallsh-%d-%d", root, getpid(), ++count);
+    if (mkdir(cgroup, 0755) < 0) {
+        perror(cgroup);
+        free(cgroup);
+        return NULL;
+    }
+
+    // cpu.max is the time allowed out of every 100 ms period.
+    int failed = 0;
+    if (limits->cpuPercent >= 0) {
+        snprintf(value, sizeof(value), "%lld 100000", limits->cpuPercent * 1000);
+        failed |= cgroupWrite(cgroup, "cpu.max", value);
+    }
+    if (limits->memory >= 0 && !failed) {
+        snprintf(value, sizeof(value), "%lld", limits->memory);
+        failed |= cgroupWrite(cgroup, "memory.max", value);
+    }
+    if (!failed) {
+        snprintf(value, sizeof(value), "%s/cgroup.procs", cgroup);
+        limits->procsFD = open(value, O_WRONLY | O_CLOEXEC);
+        failed = (limits->procsFD < 0);
+        if (failed) {
+            perror(value);
+        }
+    }
+
+    if (failed) {
+        rmdir(cgroup);
+        free(cgroup);
+        return NULL;
+    }
+    return cgroup;
+}
+
+
+/* Sets the rlimits in a child before it execs. Soft and hard limits are both set so the program
+   can't raise them again, except CPU time whose hard limit is a second later, so the program gets
+   SIGXCPU before it's killed. */
+int applyLimits(const struct limits *limits) {
+    struct rlimit r;
+    if (limits->cpuSeconds >= 0) {
+        r.rlim_cur = limits->cpuSeconds;
+        r.rlim_max = limits->cpuSeconds + 1;
+        if (setrlimit(RLIMIT_CPU, &r) < 0) {
+            return -1;
+        }
+    }
+    if (limits->addressSpace >= 0) {
+        r.rlim_cur = r.rlim_max = limits->addressSpace;
+        if (setrlimit(RLIMIT_AS, &r) < 0) {
+            return -1;
+        }
+    }
+    if (limits->files >= 0) {
+        r.rlim_cur = r.rlim_max = limits->files;
+        if (setrlimit(RLIMIT_NOFILE, &r) < 0) {
+            return -1;
+        }
+    }
+
+    // Writing 0 to cgroup.procs moves the process writing it.
+    if (limits->procsFD >= 0 && write(limits->procsFD, "0", 1) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Starts one process of a limited command. The limits have to be set in the child between fork
+   and exec, which posix_spawn has no attribute for, so this does by hand what spawnStage()
+   describes to posix_spawn. An error in the child comes back through a close-on-exec pipe, which
+   closes without anything written once the exec works, so it's reported the same way as
+   posix_spawn reports it. Returns 0, or the error. */
+int forkStage(const char *path, char *argv[], int inFD, int outFD, int errFD, pid_t pgid, int bg, const struct limits *limits, pid_t *pid) {
+    int errorPipe[2], error = 0;
+    if (pipe2(errorPipe, O_CLOEXEC) < 0) {
+        return errno;
+    }
+
+    *pid = fork();
+    if (*pid == 0) {
+        sigset_t childMask;
+        sigemptyset(&childMask);
+        if (pgid >= 0) {
+            setpgid(0, pgid);
+        }
+        if (bg == 1) {
+            signal(SIGINT, SIG_DFL);
+        }
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        if ((inFD == -1 || dup2(inFD, 0) == 0) && (outFD == -1 || dup2(outFD, 1) == 1) && (errFD == -1 || dup2(errFD, 2) == 2)
+            && applyLimits(limits) == 0) {
+            execve(path, argv, environ);
+        }
+        error = errno;
+        write(errorPipe[1], &error, sizeof(error));
+        _exit(127);
+    }
+    if (*pid < 0) {
+        error = errno;
+    }
+
+    // A child that failed has already exited, it's reaped here so it isn't mistaken for a job.
+    close(errorPipe[1]);
+    if (*pid > 0 && read(errorPipe[0], &error, sizeof(error)) == sizeof(error)) {
+        waitpid(*pid, NULL, 0);
+    } else if (*pid > 0) {
+        error = 0;
+    }
+    close(errorPipe[0]);
+    return error;
+}
+
+
+/* Starts one process of a command with posix_spawn. inFD, outFD and errFD are dup2()ed onto stdin,
+   stdout and stderr when they aren't -1. pgid is the process group to put it in: -1 to stay in the shell's,
+   0 to start a new one. The program is found with commandPath() and started from its full path
+   with posix_spawn, so the PATH isn't searched again for a command that's been run before. A
+   command with limits is started with forkStage() instead. Returns 0, or the error from posix_spawn. */
+int spawnStage(char *argv[], int inFD, int outFD, int errFD, pid_t pgid, int bg, const struct limits *limits, pid_t *pid) {
+    variablesExport();
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+
+    // The shell blocks SIGCHLD to read it from the signalfd, the new program starts with nothing blocked.
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    posix_spawnattr_setsigmask(&attr, &childMask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+
+    // Cancel/Interrupt forground process when us CTRL^C. Background processes keep ignoring it
+    // like the shell does.
+    if (bg == 1) {
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGINT);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // The shell's copies of the fds are close-on-exec, dup2() gives the child ones that aren't.
+    if (inFD != -1) {
+        posix_spawn_file_actions_adddup2(&actions, inFD, 0);
+    }
+    if (outFD != -1) {
+        posix_spawn_file_actions_adddup2(&actions, outFD, 1);
+    }
+    if (errFD != -1) {
+        posix_spawn_file_actions_adddup2(&actions, errFD, 2);
+    }
+
+    // A cached path that doesn't work anymore (the program was moved or deleted) is dropped and
+    // the PATH searched again, once.
+    int result = ENOENT, tries;
+    for (tries = 0; tries < 2 && result != 0; tries++) {
+        const char *path = commandPath(argv[0]);
+        if (path == NULL) {
+            result = ENOENT;
+            break;
+        }
+        if (limits != NULL) {
+            result = forkStage(path, argv, inFD, outFD, errFD, pgid, bg, limits, pid);
+        } else {
+            result = posix_spawn(pid, path, &actions, &attr, argv, environ);
+        }
+        if (result == 0 || path == argv[0]) {
+            break;
+        }
+        commandRemove(argv[0]);
+    }
+    if (result != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(result));
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return result;
+}
+
+
+/* Child proceses ignore ctrl^z. A signal that's ignored stays ignored across exec, so the shell
+   ignores it too while children are started, with it blocked so a CTRL^Z typed meanwhile is
+   handled once the handler is back. saved gets the shell's own action for releaseStop(). */
+void holdStop(struct sigaction *saved) {
+    sigset_t stopMask;
+    sigemptyset(&stopMask);
+    sigaddset(&stopMask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &stopMask, NULL);
+
+    struct sigaction ignore;
+    sigaction(SIGTSTP, NULL, saved);
+    ignore = *saved;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &ignore, NULL);
+}
+
+
+/* Puts the shell's CTRL^Z handler back after holdStop(). */
+void releaseStop(struct sigaction *saved) {
+    sigset_t stopMask;
+    sigemptyset(&stopMask);
+    sigaddset(&stopMask, SIGTSTP);
+    sigaction(SIGTSTP, saved, NULL);
+    sigprocmask(SIG_UNBLOCK, &stopMask, NULL);
+}
+
+
+/* The words of a pipeline joined back into one line, for the jobs command. */
+char* joinArgs(char *args[], int stages) {
+    size_t len = 1;
+    int stage, i = 0;
+    for (stage = 0; stage < stages; stage++, i++) {
+        for (; args[i] != NULL; i++) {
+            len += strlen(args[i]) + 3;
+        }
+    }
+
+    char *line = malloc(len), *out = line;
+    if (line == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    i = 0;
+    for (stage = 0; stage < stages; stage++, i++) {
+        if (stage > 0) {
+            out = stpcpy(out, " | ");
+        }
+        for (; args[i] != NULL; i++) {
+            out = stpcpy(out, args[i]);
+            if (args[i + 1] != NULL) {
+                *out++ = ' ';
+            }
+        }
+    }
+    *out = '\0';
+    return line;
+}
+
+
+/* Waits for a foreground process with wait4(). While background output is being captured the
+   pipes are read meanwhile, so a job writing a lot doesn't stop on a full pipe until the
+   foreground command is done. Only this pid is waited for, the background jobs that finish are
+   reaped after. A pid that's already been reaped counts as done, with exit value 0 and no usage. */
+void waitForeground(pid_t pid, int *status, struct rusage *used) {
+    *status = 0;
+    memset(used, 0, sizeof(*used));
+    while (captures.open > 0) {
+        // SIGCHLD is cleared first, so one that comes after is seen by the poll.
+        struct pollfd fds[1 + captures.open];
+        struct signalfd_siginfo info;
+        while (read(childFD, &info, sizeof(info)) > 0);
+        pid_t done = wait4(pid, status, WNOHANG, used);
+        if (done == pid || (done < 0 && errno == ECHILD)) {
+            return;
+        }
+        fds[0] = (struct pollfd) { childFD, POLLIN, 0 };
+        poll(fds, watchCaptures(fds, 1), -1);
+        drainCaptures();
+    }
+    wait4(pid, status, 0, used);
+}
+
+
+// What the last foreground command used, for "time".
+struct usage lastUsage;
+
+// The first process of the last background job started.
+pid_t lastBackground = 0;
+
+struct builtin;
+int runRedirected(struct builtin *b, char *args[], int inputFD, int outputFD, int lastStatus);
+
+/* Executes a command via posix_spawn and wait4(). posix_spawn starts the child without copying
+   the shell's memory (glibc uses clone() with CLONE_VM | CLONE_VFORK), so starting a command
+   costs the same however big the shell gets. What a forked child used to do before execvp is
+   described to it as spawn attributes and file actions instead.
+
+   A pipeline has its stages one after another in args, separated by NULL. All of them are
+   started before waiting on any, connected by pipes, and its status is the last stage's.
+   What every process uses is collected with wait4(), for the stats command and "time".
+
+   limits is NULL, or the limits every process of the command is started with. tail is NULL, or
+   the builtin a foreground pipeline ends in, which runs in the shell once the stages before it
+   are started, reading the last pipe as its stdin. */
+void exeCMD(char *args[], int stages, int bg, const char *inputFile, const char *outputFile, const struct limits *limits, struct builtin *tail, int* exitStatus) {
+
+    int childStatus;
+    int inputFD = -1, outputFD = -1, failed = 0;
+    int background = (bg == 0 && bgIgnore == 1);
+
+    // If there's an input file, need to open it, the first stage gets it as stdin. A background
+    // command without one reads "/dev/null" so it doesn't compete with the shell for the terminal.
+    if (inputFile != NULL || background) {
+        inputFD = openRedirect(inputFile != NULL ? inputFile : "/dev/null", O_RDONLY, background ? "input open() bg" : "input open() fg");
+        failed |= (inputFD == -1);
+    }
+
+    // If there's an output file, need to open it, the last stage gets it as stdout.
+    if (outputFile != NULL && !failed) {
+        outputFD = openRedirect(outputFile, O_WRONLY | O_CREAT | O_TRUNC, background ? "output open() bg" : "output open() fg");
+        failed |= (outputFD == -1);
+    }
+
+    // Nothing is started if a file couldn't be opened, the status is the same as a child that
+    // failed to open it.
+    if (failed) {
+        if (!background) {
+            *exitStatus = W_EXITCODE(1, 0);
+        }
+        if (inputFD != -1) {
+            close(inputFD);
+        }
+        reapJobs();
+        return;
+    }
+
+    // Anything the shell printed goes out before the command's own output. Only scripts leave
+    // output sitting in the buffer, for a prompt it's already been flushed and this does nothing.
+    fflush(stdout);
+
+    // The whole pipeline goes in one cgroup when it has cgroup limits.
+    struct limits stageLimits;
+    char *cgroup = NULL;
+    if (limits != NULL) {
+        stageLimits = *limits;
+        cgroup = cgroupCreate(&stageLimits);
+        limits = &stageLimits;
+
+        // Without a cgroup the memory limit falls back to RLIMIT_AS, but no rlimit can stand in
+        // for a share of the CPU.
+        if (cgroup == NULL && stageLimits.memory >= 0 && stageLimits.addressSpace < 0) {
+            stageLimits.addressSpace = stageLimits.memory;
+        }
+        if (cgroup == NULL && stageLimits.cpuPercent >= 0) {
+            fprintf(stderr, "limit: no cgroup to put the command in, -c is left out (see SMALLSH_CGROUP)\n");
+        }
+    }
+
+    // With $SMALLSH_CAPTURE set, a background job writes its stderr, and its stdout when that isn't
+    // redirected, into a pipe the shell reads into a ring of that many bytes.
+    int capturePipe[2] = { -1, -1 };
+    long long captureSize = -1;
+    if (background) {
+        const char *size = variableGet("SMALLSH_CAPTURE", 15);
+        captureSize = (size != NULL) ? limitSize(size) : -1;
+        if (captureSize > 0 && pipe2(capturePipe, O_CLOEXEC) < 0) {
+            perror("pipe2()");
+            captureSize = -1;
+        }
+    }
+
+    // Child proceses ignore ctrl^z.
+    struct sigaction stopAction;
+    holdStop(&stopAction);
+    long long startNS = nowNS();
+
+    // A background pipeline gets a process group of its own, led by its first stage, so the job
+    // can be signalled as one. A foreground one stays in the shell's group, which is the one the
+    // terminal sends CTRL^C to.
+    pid_t pids[stages];
+    pid_t pgid = background ? 0 : -1;
+    int stage, lastResult = 0;
+    int spawned = (tail != NULL) ? stages - 1 : stages;
+    char **argv = args;
+    int readFD = inputFD;
+
+    pids[stages - 1] = -1;
+    for (stage = 0; stage < spawned; stage++) {
+        // Every stage but the last writes into a pipe the next one reads from.
+        int pipeFDs[2] = { -1, -1 };
+        int writeFD = (stage == stages - 1) ? (outputFD != -1 ? outputFD : capturePipe[1]) : -1;
+        if (stage < stages - 1) {
+            if (pipe2(pipeFDs, O_CLOEXEC) < 0) {
+                perror("pipe2()");
+                exit(1);
+            }
+            writeFD = pipeFDs[1];
+        }
+
+        // Executes the new program.
+        lastResult = spawnStage(argv, readFD, writeFD, capturePipe[1], pgid, bg, limits, &pids[stage]);
+        if (lastResult != 0) {
+            pids[stage] = -1;
+        } else if (pgid == 0) {
+            pgid = pids[stage];
+        }
+
+        // The child has its own copies of the pipe ends now.
+        if (readFD != -1 && readFD != inputFD) {
+            close(readFD);
+        }
+        if (pipeFDs[1] != -1) {
+            close(pipeFDs[1]);
+        }
+        readFD = pipeFDs[0];
+
+        // Moves on to the words of the next stage.
+        while (*argv != NULL) {
+            argv++;
+        }
+        argv++;
+    }
+
+    releaseStop(&stopAction);
+
+    if (inputFD != -1) {
+        close(inputFD);
+    }
+    if (outputFD != -1 && tail == NULL) {
+        close(outputFD);
+    }
+    if (capturePipe[1] != -1) {
+        close(capturePipe[1]);
+    }
+    if (limits != NULL && limits->procsFD != -1) {
+        close(limits->procsFD);
+    }
+
+    // Checks to see if we want to run the command in the background and if background commands are currently allowed.
+    if (background) {
+        // Adds the processes to the job table as one job led by the first one that started,
+        // they're reaped when SIGCHLD says they're done.
+        int started = 0;
+        for (stage = 0; stage < stages; stage++) {
+            if (pids[stage] > 0) {
+                jobAdd(pids[stage], pgid);
+                started++;
+            }
+        }
+        if (started > 0) {
+            int l = jobFind(pgid);
+            if (jobs.count == started) {
+                jobs.nextId = 1;
+            }
+            jobs.slots[l].id = jobs.nextId++;
+            jobs.slots[l].command = joinArgs(args, stages);
+            jobs.slots[l].cgroup = cgroup;
+            cgroup = NULL;
+            jobs.slots[l].usage.startNS = startNS;
+            jobs.slots[l].running = started;
+            jobs.slots[l].last = pids[stages - 1];
+            // The last stage failed to start, it counts as exit value 2 like it did before.
+            jobs.slots[l].status = W_EXITCODE(2, 0);
+
+            // Only the shell reads the pipe, and never waits on it.
+            if (capturePipe[0] != -1) {
+                fcntl(capturePipe[0], F_SETFL, O_NONBLOCK);
+                captureAdd(pgid, jobs.slots[l].id, capturePipe[0], captureSize);
+                capturePipe[0] = -1;
+            }
+
+            //Prints child pid of the background process
+            printf("background pid is %d\n", pgid);
+            fflush(stdout);
+            traceStart(pgid, jobs.slots[l].command);
+            lastBackground = pgid;
+        }
+
+    // Otherwise we run in the forground.
+    } else {
+        char *command = joinArgs(args, stages);
+        struct usage used = { startNS };
+        struct rusage stageUsed;
+        pid_t first = 0;
+        for (stage = 0; stage < stages; stage++) {
+            if (pids[stage] > 0 && first == 0) {
+                first = pids[stage];
+                traceStart(first, command);
+            }
+        }
+
+        // argv is at the builtin's words now. It reads what the stages write while they run, so
+        // they're only waited on once it's done.
+        int tailResult = 0;
+        if (tail != NULL) {
+            // The children it waits for are reaped with wait4(-1), which would take the stages
+            // too, so they're in the job table like parallel's commands meanwhile.
+            for (stage = 0; stage < spawned; stage++) {
+                if (pids[stage] > 0) {
+                    jobAdd(pids[stage], pids[stage]);
+                    jobs.slots[jobFind(pids[stage])].task = 1;
+                }
+            }
+            tailResult = runRedirected(tail, argv, readFD, outputFD, *exitStatus);
+            close(readFD);
+            if (outputFD != -1) {
+                close(outputFD);
+            }
+        }
+        for (stage = 0; stage < stages; stage++) {
+            int j = (tail != NULL && pids[stage] > 0) ? jobFind(pids[stage]) : -1;
+            if (j >= 0 && jobs.slots[j].done) {
+                childStatus = jobs.slots[j].status;
+                usageJoin(&used, &jobs.slots[j].usage);
+            } else if (pids[stage] > 0) {
+                waitForeground(pids[stage], &childStatus, &stageUsed);
+                usageAdd(&used, &stageUsed);
+            }
+            if (j >= 0) {
+                jobRemove(pids[stage]);
+            }
+        }
+
+        // The status of a stage that couldn't be started is the same as a child whose exec failed.
+        if (tail != NULL) {
+            childStatus = W_EXITCODE(tailResult, 0);
+        } else if (lastResult != 0) {
+            childStatus = W_EXITCODE(2, 0);
+        }
+
+        used.wallNS = nowNS() - startNS;
+        lastUsage = used;
+        if (first != 0) {
+            recordCommand(first, childStatus, &used, command);
+        } else {
+            free(command);
+        }
+
+        // If there is an interuption such as CTRL^C.
+        if (childStatus == 2) {
+            status(childStatus);
+        }
+
+        // Updates the exitstatus to be the childstatus.
+        *exitStatus = childStatus;
+    }
+
+    // Nothing was started to write to the capture pipe.
+    if (capturePipe[0] != -1) {
+        close(capturePipe[0]);
+    }
+
+    // The cgroup of a command that's finished, or never started, goes away.
+    if (cgroup != NULL) {
+        rmdir(cgroup);
+        free(cgroup);
+    }
+
+    // Reports the background processes that finished while this one ran.
+    reapJobs();
+}
+
+
+/* Handles the backslash escape starting at s, just after the "\", putting the char it stands for
+   in *c. Octal escapes are "\0NNN" for echo -e and printf's %b but "\NNN" in a printf format,
+   zeroOctal picks which. Returns how many chars after the "\" it used, or -1 for "\c", which
+   ends the output. Anything that isn't an escape is left as a plain "\". */
+int unescape(const char *s, int zeroOctal, char *c) {
+    int n = 0, value = 0;
+    switch (*s) {
+    case 'a': *c = '\a'; return 1;
+    case 'b': *c = '\b'; return 1;
+    case 'c': return -1;
+    case 'e': *c = 27; return 1;
+    case 'f': *c = '\f'; return 1;
+    case 'n': *c = '\n'; return 1;
+    case 'r': *c = '\r'; return 1;
+    case 't': *c = '\t'; return 1;
+    case 'v': *c = '\v'; return 1;
+    case '\\': *c = '\\'; return 1;
+
+    // Up to 2 hex digits.
+    case 'x':
+        while (n < 2 && isxdigit((unsigned char) s[n + 1])) {
+            char d = tolower((unsigned char) s[n + 1]);
+            value = value * 16 + (isdigit((unsigned char) d) ? d - '0' : d - 'a' + 10);
+            n++;
+        }
+        if (n == 0) {
+            break;
+        }
+        *c = (char) value;
+        return n + 1;
+    }
+
+    // Up to 3 octal digits, after the "0" if there has to be one.
+    int start = (zeroOctal && *s == '0') ? 1 : 0;
+    if (zeroOctal && start == 0) {
+        *c = '\\';
+        return 0;
+    }
+    while (n < 3 && s[start + n] >= '0' && s[start + n] <= '7') {
+        value = value * 8 + (s[start + n] - '0');
+        n++;
+    }
+    if (start + n == 0) {
+        *c = '\\';
+        return 0;
+    }
+    *c = (char) value;
+    return start + n;
+}
+
+
+/* Prints s with its backslash escapes turned into chars. Returns 1 if a "\c" stopped it. */
+int printEscaped(const char *s, int zeroOctal) {
+    while (*s != '\0') {
+        if (*s != '\\') {
+            putchar(*s++);
+            continue;
+        }
+        char c;
+        int n = unescape(s + 1, zeroOctal, &c);
+        if (n < 0) {
+            return 1;
+        }
+        putchar(c);
+        s += 1 + n;
+    }
+    return 0;
+}
+
+
+/* Built in echo, like coreutils echo: -n leaves out the newline, -e turns on backslash escapes and
+   -E turns them off again. Options can be put together ("-ne"), any other word starting with "-"
+   is printed. */
+int echoCMD(char *args[], int lastStatus) {
+    int newline = 1, escapes = 0, i;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) {
+            break;
+        }
+        const char *option;
+        for (option = args[i] + 1; *option != '\0'; option++) {
+            if (*option == 'n') {
+                newline = 0;
+            } else {
+                escapes = (*option == 'e');
+            }
+        }
+    }
+
+    for (; args[i] != NULL; i++) {
+        if (!escapes) {
+            fputs(args[i], stdout);
+        } else if (printEscaped(args[i], 1)) {
+            // "\c" also leaves out the newline.
+            return 0;
+        }
+        if (args[i + 1] != NULL) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+
+/* Built in true and false. */
+int trueCMD(char *args[], int lastStatus) {
+    return 0;
+}
+
+int falseCMD(char *args[], int lastStatus) {
+    return 1;
+}
+
+
+/* Built in pwd. */
+int pwdCMD(char *args[], int lastStatus) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+
+/* The arguments test is working through, and the next one to look at. */
+struct testArgs {
+    char **args;
+    int count, next;
+    // Set once the expression turns out to be wrong, test exits with 2 then.
+    int error;
+};
+
+
+/* Whether s is one of test's file or string checks, like "-f". */
+int testIsUnary(const char *s) {
+    return s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr("bcdefghknprstuwxzGLOS", s[1]) != NULL;
+}
+
+
+/* Whether s is one of test's comparisons, like "=" or "-lt". */
+int testIsBinary(const char *s) {
+    const char *ops[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef" };
+    int i;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(s, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Reads an integer for a test comparison, setting the error if it isn't one. */
+long long testInteger(struct testArgs *t, const char *s) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(s, &end, 10);
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    if (end == s || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expected\n", s);
+        t->error = 1;
+    }
+    return value;
+}
+
+
+/* Checks a file or string with one of the unary operators, op is the letter after the "-". */
+int testUnary(char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+
+    // The rest are about what the file is, following links.
+    if (stat(arg, &st) != 0) {
+        return 0;
+    }
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 's': return st.st_size > 0;
+    case 'G': return st.st_gid == getegid();
+    case 'O': return st.st_uid == geteuid();
+    }
+    // 'e', the file exists.
+    return 1;
+}
+
+
+/* Compares a and b with one of the binary operators. */
+int testBinary(struct testArgs *t, const char *a, const char *op, const char *b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(a, b) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(a, b) != 0;
+    }
+
+    // File comparisons, a file that doesn't exist is older than one that does.
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        int hasA = (stat(a, &sa) == 0), hasB = (stat(b, &sb) == 0);
+        if (op[1] == 'e') {
+            return hasA && hasB && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        }
+        if (op[1] == 'o') {
+            struct stat swap = sa;
+            int hasSwap = hasA;
+            sa = sb;
+            hasA = hasB;
+            sb = swap;
+            hasB = hasSwap;
+        }
+        if (!hasA || !hasB) {
+            return hasA;
+        }
+        return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+               (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+    }
+
+    long long x = testInteger(t, a), y = testInteger(t, b);
+    switch (op[1] * 256 + op[2]) {
+    case 'e' * 256 + 'q': return x == y;
+    case 'n' * 256 + 'e': return x != y;
+    case 'l' * 256 + 't': return x < y;
+    case 'l' * 256 + 'e': return x <= y;
+    case 'g' * 256 + 't': return x > y;
+    }
+    // "-ge".
+    return x >= y;
+}
+
+
+int testOr(struct testArgs *t);
+
+/* One check: "( expr )", "a op b", "-op a", or a word on its own, which is true if it isn't
+   empty. "a op b" is tried first, so "-n = x" compares strings like POSIX says. */
+int testPrimary(struct testArgs *t) {
+    int left = t->count - t->next;
+    char **a = t->args + t->next;
+    if (left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+
+    if (left >= 3 && testIsBinary(a[1])) {
+        t->next += 3;
+        return testBinary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->next++;
+        int value = testOr(t);
+        if (t->next >= t->count || strcmp(t->args[t->next], ")") != 0) {
+            if (!t->error) {
+                fprintf(stderr, "test: ')' expected\n");
+            }
+            t->error = 1;
+            return 0;
+        }
+        t->next++;
+        return value;
+    }
+    if (left >= 2 && testIsUnary(a[0])) {
+        t->next += 2;
+        return testUnary(a[0][1], a[1]);
+    }
+    t->next++;
+    return a[0][0] != '\0';
+}
+
+
+/* "! expr", unless the "!" is being compared to something. */
+int testNot(struct testArgs *t) {
+    int left = t->count - t->next;
+    if (left >= 2 && strcmp(t->args[t->next], "!") == 0 && !(left >= 3 && testIsBinary(t->args[t->next + 1]))) {
+        t->next++;
+        return !testNot(t);
+    }
+    return testPrimary(t);
+}
+
+
+/* "expr -a expr", which binds tighter than -o. */
+int testAnd(struct testArgs *t) {
+    int value = testNot(t);
+    while (t->next < t->count && strcmp(t->args[t->next], "-a") == 0) {
+        t->next++;
+        value = testNot(t) && value;
+    }
+    return value;
+}
+
+
+/* "expr -o expr". */
+int testOr(struct testArgs *t) {
+    int value = testAnd(t);
+    while (t->next < t->count && strcmp(t->args[t->next], "-o") == 0) {
+        t->next++;
+        value = testAnd(t) || value;
+    }
+    return value;
+}
+
+
+/* Built in test and "[", which is the same with a "]" at the end. Exits with 0 if the expression
+   is true, 1 if it's false and 2 if it can't be made sense of. */
+int testCMD(char *args[], int lastStatus) {
+    struct testArgs t = { args + 1, 0, 0, 0 };
+    while (t.args[t.count] != NULL) {
+        t.count++;
+    }
+
+    if (strcmp(args[0], "[") == 0) {
+        if (t.count == 0 || strcmp(t.args[t.count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        t.count--;
+    }
+
+    // No expression at all is false.
+    if (t.count == 0) {
+        return 1;
+    }
+
+    int value = testOr(&t);
+    if (!t.error && t.next < t.count) {
+        fprintf(stderr, "test: %s: unexpected argument\n", t.args[t.next]);
+        t.error = 1;
+    }
+    if (t.error) {
+        return 2;
+    }
+    return value ? 0 : 1;
+}
+
+
+/* Reads a number for printf, where 'c (or "c) is the value of the char c and a missing argument
+   is 0. Prints an error and sets *failed if it isn't a number. */
+long long printfInteger(const char *s, int *failed) {
+    if (s == NULL) {
+        return 0;
+    }
+    if (s[0] == '\'' || s[0] == '"') {
+        return (unsigned char) s[1];
+    }
+    char *end;
+    errno = 0;
+    long long value = strtoll(s, &end, 0);
+    if (end == s || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        *failed = 1;
+    }
+    return value;
+}
+
+double printfDouble(const char *s, int *failed) {
+    if (s == NULL) {
+        return 0;
+    }
+    if (s[0] == '\'' || s[0] == '"') {
+        return (unsigned char) s[1];
+    }
+    char *end;
+    errno = 0;
+    double value = strtod(s, &end);
+    if (end == s || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        *failed = 1;
+    }
+    return value;
+}
+
+
+/* Built in printf. Each conversion is handed to the C printf() with its flags, width and
+   precision. The format is used again while there are arguments left, and a missing argument
+   is "" or 0. */
+int printfCMD(char *args[], int lastStatus) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    const char *format = args[1];
+    char **next = args + 2, **passStart;
+    int failed = 0;
+
+    do {
+        passStart = next;
+        const char *f = format;
+        while (*f != '\0') {
+
+            // Plain chars and escapes.
+            if (*f == '\\') {
+                char c;
+                int n = unescape(f + 1, 0, &c);
+                if (n < 0) {
+                    return failed;
+                }
+                putchar(c);
+                f += 1 + n;
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f++);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f += 2;
+                continue;
+            }
+
+            // Copies "%[flags][width][.precision]", with a "*" replaced by the number from the
+            // next argument, room is left for the "ll" and the conversion.
+            char spec[64];
+            int len = 0, part;
+            spec[len++] = *f++;
+            while (*f != '\0' && strchr("-+ #0", *f) != NULL && len < 8) {
+                spec[len++] = *f++;
+            }
+            for (part = 0; part < 2; part++) {
+                if (*f == '*') {
+                    len += snprintf(spec + len, 16, "%d", (int) printfInteger(*next, &failed));
+                    next += (*next != NULL);
+                    f++;
+                } else {
+                    int digits = 0;
+                    while (isdigit((unsigned char) *f) && digits++ < 10) {
+                        spec[len++] = *f++;
+                    }
+                }
+                if (part == 0 && *f == '.') {
+                    spec[len++] = *f++;
+                } else {
+                    break;
+                }
+            }
+
+            char conv = *f;
+            if (conv == '\0') {
+                fprintf(stderr, "printf: %s: missing conversion\n", format);
+                return 1;
+            }
+            f++;
+            const char *arg = *next;
+            next += (arg != NULL);
+
+            switch (conv) {
+            case 'd':
+            case 'i':
+                strcpy(spec + len, "lld");
+                printf(spec, printfInteger(arg, &failed));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                snprintf(spec + len, 4, "ll%c", conv);
+                printf(spec, (unsigned long long) printfInteger(arg, &failed));
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                snprintf(spec + len, 2, "%c", conv);
+                printf(spec, printfDouble(arg, &failed));
+                break;
+            case 'c':
+                strcpy(spec + len, "c");
+                if (arg != NULL && arg[0] != '\0') {
+                    printf(spec, arg[0]);
+                }
+                break;
+            case 's':
+                strcpy(spec + len, "s");
+                printf(spec, arg != NULL ? arg : "");
+                break;
+            case 'b':
+                if (arg != NULL && printEscaped(arg, 1)) {
+                    return failed;
+                }
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid conversion\n", conv);
+                return 1;
+            }
+        }
+    } while (*next != NULL && next != passStart);
+
+    return failed;
+}
+
+
+/* Signals kill knows by name, without the "SIG". */
+struct signalName {
+    const char *name;
+    int number;
+};
+
+struct signalName signalNames[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL }, { "TRAP", SIGTRAP },
+    { "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+    { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+    { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+    { "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ }, { "VTALRM", SIGVTALRM },
+    { "PROF", SIGPROF }, { "WINCH", SIGWINCH }, { "IO", SIGIO }, { "SYS", SIGSYS },
+};
+
+
+/* Signal number from a number or a name ("TERM", "SIGTERM", in any case). Returns -1 if it's neither. */
+int signalNumber(const char *s) {
+    if (isdigit((unsigned char) s[0])) {
+        char *end;
+        long n = strtol(s, &end, 10);
+        return (*end == '\0' && n < NSIG) ? (int) n : -1;
+    }
+    if (strncasecmp(s, "SIG", 3) == 0) {
+        s += 3;
+    }
+    int i;
+    for (i = 0; i < sizeof(signalNames) / sizeof(signalNames[0]); i++) {
+        if (strcasecmp(signalNames[i].name, s) == 0) {
+            return signalNames[i].number;
+        }
+    }
+    return -1;
+}
+
+
+/* Built in kill: "kill [-s signal | -signal] pid...", sending SIGTERM if no signal is given. A
+   negative pid is a process group, like a background pipeline. "kill -l" lists the signal names,
+   and "kill -l status" names the signal a status of 128 + the signal stands for. */
+int killCMD(char *args[], int lastStatus) {
+    const char *usage = "kill: usage: kill [-s signal | -signal] pid... or kill -l [status]\n";
+    const char *signalArg = NULL;
+    int count = sizeof(signalNames) / sizeof(signalNames[0]);
+    int sig = SIGTERM, result = 0, i = 1, j;
+
+    if (args[1] != NULL && strcmp(args[1], "-l") == 0) {
+        if (args[2] == NULL) {
+            for (j = 0; j < count; j++) {
+                printf("%s%c", signalNames[j].name, j == count - 1 ? '\n' : ' ');
+            }
+            return 0;
+        }
+        for (i = 2; args[i] != NULL; i++) {
+            int n = atoi(args[i]);
+            n = (n > 128) ? n - 128 : n;
+            for (j = 0; j < count && signalNames[j].number != n; j++);
+            if (j < count) {
+                printf("%s\n", signalNames[j].name);
+            } else {
+                fprintf(stderr, "kill: %s: invalid signal\n", args[i]);
+                result = 1;
+            }
+        }
+        return result;
+    }
+
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+        signalArg = args[2];
+        i = 3;
+        if (signalArg == NULL) {
+            fprintf(stderr, "%s", usage);
+            return 2;
+        }
+    } else if (args[1] != NULL && args[1][0] == '-' && strcmp(args[1], "--") != 0) {
+        signalArg = args[1] + 1;
+        i = 2;
+    }
+    if (signalArg != NULL && (sig = signalNumber(signalArg)) < 0) {
+        fprintf(stderr, "kill: %s: invalid signal\n", signalArg);
+        return 1;
+    }
+    if (args[i] != NULL && strcmp(args[i], "--") == 0) {
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "%s", usage);
+        return 2;
+    }
+
+    for (; args[i] != NULL; i++) {
+        char *end;
+        long pid = strtol(args[i], &end, 10);
+        if (end == args[i] || *end != '\0') {
+            fprintf(stderr, "kill: %s: arguments must be process IDs\n", args[i]);
+            result = 1;
+        } else if (kill((pid_t) pid, sig) < 0) {
+            fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+            result = 1;
+        }
+    }
+    return result;
+}
+
+
+// Set by CTRL^C while wait or parallel is waiting, the only time the shell doesn't ignore it.
+volatile sig_atomic_t interrupted = 0;
+
+void SIGINT_handler(int signo) {
+    interrupted = 1;
+}
+
+
+/* Lets CTRL^C stop wait and parallel. SIGINT is caught instead of ignored, and kept blocked
+   except while waitChild() waits, so it can't slip in between checking interrupted and starting
+   to wait. waitMask gets the signal mask to wait with, saved the action to put back after. */
+void catchInterrupt(struct sigaction *saved, sigset_t *waitMask) {
+    sigset_t intMask;
+    sigemptyset(&intMask);
+    sigaddset(&intMask, SIGINT);
+    sigprocmask(SIG_BLOCK, &intMask, waitMask);
+    sigdelset(waitMask, SIGINT);
+
+    struct sigaction action = {{0}};
+    action.sa_handler = SIGINT_handler;
+    sigfillset(&action.sa_mask);
+    sigaction(SIGINT, &action, saved);
+    interrupted = 0;
+}
+
+
+/* Goes back to ignoring CTRL^C after catchInterrupt(). */
+void releaseInterrupt(struct sigaction *saved) {
+    sigset_t intMask;
+    sigemptyset(&intMask);
+    sigaddset(&intMask, SIGINT);
+    sigaction(SIGINT, saved, NULL);
+    sigprocmask(SIG_UNBLOCK, &intMask, NULL);
+}
+
+
+/* Waits until a child finishes or CTRL^C is pressed, then reaps whatever has finished. Captured
+   output is read meanwhile. */
+void waitChild(const sigset_t *waitMask) {
+    struct pollfd fds[1 + captures.open];
+    fds[0] = (struct pollfd) { childFD, POLLIN, 0 };
+    ppoll(fds, watchCaptures(fds, 1), NULL, waitMask);
+    drainCaptures();
+    reapJobs();
+}
+
+
+/* Finds the background job a wait argument names, either a pid or "%N" for job N. Returns the
+   job's leader, or -1 if there's no such job. */
+pid_t jobLeader(const char *name) {
+    char *end;
+    long n = strtol(name + (name[0] == '%'), &end, 10);
+    if (end == name + (name[0] == '%') || *end != '\0') {
+        return -1;
+    }
+
+    int i;
+    if (name[0] == '%') {
+        for (i = 0; i < jobs.size; i++) {
+            if (jobs.slots[i].pid > 0 && jobs.slots[i].pid == jobs.slots[i].leader && !jobs.slots[i].task && jobs.slots[i].id == n) {
+                return jobs.slots[i].leader;
+            }
+        }
+        return -1;
+    }
+
+    // Any process of a pipeline stands for the whole job.
+    i = jobFind((pid_t) n);
+    return (i >= 0 && !jobs.slots[i].task) ? jobs.slots[i].leader : -1;
+}
+
+
+/* Orders jobs by number, for the jobs command. */
+int jobOrder(const void *a, const void *b) {
+    return (*(struct job**) a)->id - (*(struct job**) b)->id;
+}
+
+
+/* Adds the CPU time a process still running has used so far to u, and its memory use now to *rss,
+   from /proc/<pid>/stat, since wait4() only has them once it's done. */
+void procUsage(pid_t pid, struct usage *u, long *rss) {
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+    stat[n] = '\0';
+
+    // The fields start after the command name, which is in parentheses and can have anything in it.
+    char *fields = strrchr(stat, ')');
+    unsigned long long userTicks, sysTicks;
+    long pages;
+    if (fields != NULL && sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                                 &userTicks, &sysTicks, &pages) == 3) {
+        long ticks = sysconf(_SC_CLK_TCK);
+        u->userUS += userTicks * 1000000LL / ticks;
+        u->sysUS += sysTicks * 1000000LL / ticks;
+        *rss += pages * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+}
+
+
+/* Finds the capture of the job a "jobs -o" argument names, a pid or "%N", whether the job is
+   still running or one of the last CAPTURE_KEEP done. Returns NULL if there isn't one. */
+struct capture* captureFind(const char *name) {
+    char *end;
+    long n = strtol(name + (name[0] == '%'), &end, 10);
+    if (end == name + (name[0] == '%') || *end != '\0') {
+        return NULL;
+    }
+
+    // Job numbers start over once no jobs are left, the newest job with the number is the one meant.
+    pid_t leader = (name[0] == '%') ? -1 : jobLeader(name);
+    int i;
+    for (i = captures.count - 1; i >= 0; i--) {
+        struct capture *c = captures.list[i];
+        if ((name[0] == '%' && c->id == n) || (name[0] != '%' && (c->leader == n || c->leader == leader))) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+
+/* Prints what a job's capture holds, oldest byte first, saying how much was dropped before it. */
+void capturePrint(const struct capture *c) {
+    if (c->total <= (long long) c->size) {
+        fwrite(c->ring, 1, c->total, stdout);
+        return;
+    }
+
+    // A full ring starts at the oldest byte and goes on from the front.
+    size_t pos = c->total % c->size;
+    fflush(stdout);
+    fprintf(stderr, "jobs: %lld earlier bytes dropped\n", c->total - (long long) c->size);
+    fwrite(c->ring + pos, 1, c->size - pos, stdout);
+    fwrite(c->ring, 1, pos, stdout);
+}
+
+
+/* Built in jobs, lists the background jobs that haven't finished in the order they were
+   started, as "[N] pid command". "jobs -v" adds how long each has been running, the CPU time
+   it has used and the memory its processes use now. "jobs -o %N" prints the output captured
+   from job N (see $SMALLSH_CAPTURE), which is kept a while after the job is done too. */
+int jobsCMD(char *args[], int lastStatus) {
+    if (args[1] != NULL && strcmp(args[1], "-o") == 0) {
+        if (args[2] == NULL) {
+            fprintf(stderr, "jobs: usage: jobs -o pid|%%N\n");
+            return 2;
+        }
+        drainCaptures();
+        struct capture *c = captureFind(args[2]);
+        if (c == NULL) {
+            fprintf(stderr, "jobs: %s: no captured output\n", args[2]);
+            return 1;
+        }
+        capturePrint(c);
+        return 0;
+    }
+
+    int verbose = (args[1] != NULL && strcmp(args[1], "-v") == 0);
+    struct job *list[jobs.count + 1];
+    int count = 0, i;
+    for (i = 0; i < jobs.size; i++) {
+        if (jobs.slots[i].pid > 0 && jobs.slots[i].pid == jobs.slots[i].leader && !jobs.slots[i].task) {
+            list[count++] = &jobs.slots[i];
+        }
+    }
+    qsort(list, count, sizeof(list[0]), jobOrder);
+    for (i = 0; i < count; i++) {
+        if (!verbose) {
+            printf("[%d] %d %s\n", list[i]->id, list[i]->pid, list[i]->command);
+            continue;
+        }
+
+        // What the finished processes used, and so far what the ones still running have.
+        struct usage u = list[i]->usage;
+        long rss = 0;
+        int j;
+        for (j = 0; j < jobs.size; j++) {
+            if (jobs.slots[j].pid > 0 && jobs.slots[j].leader == list[i]->pid && !jobs.slots[j].done) {
+                procUsage(jobs.slots[j].pid, &u, &rss);
+            }
+        }
+        printf("[%d] %d  wall %.2fs  user %.2fs  sys %.2fs  rss %ld KB  %s\n", list[i]->id, list[i]->pid,
+               (nowNS() - u.startNS) / 1e9, u.userUS / 1e6, u.sysUS / 1e6, rss, list[i]->command);
+    }
+    return 0;
+}
+
+
+/* Built in stats, what each of the last HISTORY_SIZE finished commands used, oldest first, and
+   the totals for every command the shell has run. */
+int statsCMD(char *args[], int lastStatus) {
+    int shown = (history.count < HISTORY_SIZE) ? history.count : HISTORY_SIZE, i;
+
+    printf("%8s %6s %9s %9s %9s %10s %7s %7s  %s\n", "pid", "status", "wall s", "user s", "sys s", "maxrss KB",
+           "vcsw", "ivcsw", "command");
+    for (i = 0; i < shown; i++) {
+        struct record *r = &history.records[(history.next - shown + i + HISTORY_SIZE) % HISTORY_SIZE];
+        printf("%8d %6d %9.3f %9.3f %9.3f %10ld %7ld %7ld  %s\n", r->pid, exitValue(r->status), r->usage.wallNS / 1e9,
+               r->usage.userUS / 1e6, r->usage.sysUS / 1e6, r->usage.maxRSS, r->usage.voluntary, r->usage.involuntary,
+               r->command);
+    }
+    printf("%d commands, wall %.3f s, user %.3f s, sys %.3f s, largest maxrss %ld KB\n", history.count,
+           history.wallNS / 1e9, history.userUS / 1e6, history.sysUS / 1e6, history.maxRSS);
+    return 0;
+}
+
+
+/* Built in wait: "wait" waits for every background job, "wait pid..." or "wait %N..." for just
+   those, reporting them as they finish the same as at the prompt. Exits with the exit value of
+   the last job named (127 if it isn't a job), 0 with no jobs named, or 130 if CTRL^C stopped it. */
+int waitCMD(char *args[], int lastStatus) {
+    struct sigaction saved;
+    sigset_t waitMask;
+    int result = 0, i;
+
+    catchInterrupt(&saved, &waitMask);
+    if (args[1] == NULL) {
+        while (jobs.count > 0 && !interrupted) {
+            waitChild(&waitMask);
+        }
+    }
+
+    for (i = 1; args[i] != NULL && !interrupted; i++) {
+        waitedLeader = jobLeader(args[i]);
+        if (waitedLeader < 0) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            result = 127;
+            continue;
+        }
+        while (jobFind(waitedLeader) >= 0 && !interrupted) {
+            waitChild(&waitMask);
+        }
+        result = exitValue(waitedStatus);
+    }
+    waitedLeader = 0;
+    releaseInterrupt(&saved);
+
+    return interrupted ? 130 : result;
+}
+
+
+/* A copy of word with every "{}" in it replaced by input. */
+char* replaceBraces(const char *word, const char *input) {
+    size_t inputLen = strlen(input), len = strlen(word) + 1;
+    const char *p;
+    for (p = strstr(word, "{}"); p != NULL; p = strstr(p + 2, "{}")) {
+        len += inputLen;
+    }
+
+    char *copy = malloc(len), *out = copy;
+    if (copy == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    while ((p = strstr(word, "{}")) != NULL) {
+        memcpy(out, word, p - word);
+        out = stpcpy(out + (p - word), input);
+        word = p + 2;
+    }
+    strcpy(out, word);
+    return copy;
+}
+
+
+/* Commands started by parallel and xargs, which run at most limit at once. */
+struct taskPool {
+    // Slots for the commands running, 0 when free.
+    pid_t *running;
+    int limit, active;
+    // Commands that exited with anything but 0, and ones that couldn't be started.
+    int failed, notStarted;
+};
+
+
+/* Sets up a pool for running up to limit commands at once. */
+void taskPoolInit(struct taskPool *pool, int limit) {
+    pool->running = calloc(limit + 1, sizeof(pid_t));
+    if (pool->running == NULL) {
+        perror("calloc()");
+        exit(1);
+    }
+    pool->limit = limit;
+    pool->active = 0;
+    pool->failed = 0;
+    pool->notStarted = 0;
+}
+
+
+/* Starts a command in a free slot of the pool. command is the text it's listed and recorded
+   under, which the pool takes over. Returns 0, or the error from starting it. */
+int taskStart(struct taskPool *pool, char *argv[], char *command) {
+    pid_t pid;
+    int result = spawnStage(argv, -1, -1, -1, -1, 1, NULL, &pid), slot;
+    if (result != 0) {
+        pool->notStarted++;
+        free(command);
+        return result;
+    }
+    jobAdd(pid, pid);
+    int j = jobFind(pid);
+    jobs.slots[j].task = 1;
+    jobs.slots[j].command = command;
+    jobs.slots[j].usage.startNS = nowNS();
+    traceStart(pid, command);
+    for (slot = 0; pool->running[slot] != 0; slot++);
+    pool->running[slot] = pid;
+    pool->active++;
+    return 0;
+}
+
+
+/* Waits until one of the pool's commands finishes or CTRL^C is pressed, and frees the slots of
+   the ones that finished. */
+void taskWait(struct taskPool *pool, const sigset_t *waitMask) {
+    int slot;
+    waitChild(waitMask);
+    for (slot = 0; slot < pool->limit; slot++) {
+        int j = (pool->running[slot] != 0) ? jobFind(pool->running[slot]) : -1;
+        if (j >= 0 && jobs.slots[j].done) {
+            pool->failed += (exitValue(jobs.slots[j].status) != 0);
+            jobs.slots[j].usage.wallNS = nowNS() - jobs.slots[j].usage.startNS;
+            recordCommand(pool->running[slot], jobs.slots[j].status, &jobs.slots[j].usage, jobs.slots[j].command);
+            jobs.slots[j].command = NULL;
+            jobRemove(pool->running[slot]);
+            pool->running[slot] = 0;
+            pool->active--;
+        }
+    }
+}
+
+
+/* Built in parallel: "parallel [-j N] command [words...] ::: input..." runs the command once for
+   every input, with the input in place of every "{}", or added at the end if there isn't one. At most N (the
+   number of CPUs by default) run at once, started in the order given, the next one as soon as
+   one is reaped. Exits with how many failed (up to 101, like GNU parallel), or 130 if CTRL^C
+   stopped it, which starts nothing more but waits for the ones running. */
+int parallelCMD(char *args[], int lastStatus) {
+    const char *usage = "parallel: usage: parallel [-j N] command [words...] ::: input...\n";
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1, sep, inputs = 0, words, i;
+
+    if (args[1] != NULL && strncmp(args[1], "-j", 2) == 0) {
+        const char *n = (args[1][2] != '\0') ? args[1] + 2 : args[2];
+        first = (args[1][2] != '\0') ? 2 : 3;
+        limit = (n != NULL) ? atol(n) : 0;
+    }
+    for (sep = first; args[sep] != NULL && strcmp(args[sep], ":::") != 0; sep++);
+    if (args[sep] == NULL || sep == first || limit < 1) {
+        fprintf(stderr, "%s", usage);
+        return 2;
+    }
+    words = sep - first;
+    for (i = sep + 1; args[i] != NULL; i++) {
+        inputs++;
+    }
+    if (limit > inputs) {
+        limit = inputs;
+    }
+
+    struct taskPool pool;
+    char *argv[words + 2];
+    char **input = args + sep + 1;
+    taskPoolInit(&pool, limit);
+
+    // Children ignore CTRL^Z, and CTRL^C reaches them as well as stopping parallel.
+    struct sigaction savedStop, savedInt;
+    sigset_t waitMask;
+    holdStop(&savedStop);
+    catchInterrupt(&savedInt, &waitMask);
+    fflush(stdout);
+
+    while (1) {
+        // Starts the next inputs while there are free slots.
+        while (pool.active < pool.limit && *input != NULL && !interrupted) {
+            int braces = 0;
+            for (i = 0; i < words; i++) {
+                argv[i] = args[first + i];
+                if (strstr(argv[i], "{}") != NULL) {
+                    argv[i] = replaceBraces(argv[i], *input);
+                    braces = 1;
+                }
+            }
+            argv[words] = braces ? NULL : *input;
+            argv[words + 1] = NULL;
+            input++;
+
+            // The child has its own copy of the words once posix_spawn returns.
+            taskStart(&pool, argv, joinArgs(argv, 1));
+            for (i = 0; i < words; i++) {
+                if (argv[i] != args[first + i]) {
+                    free(argv[i]);
+                }
+            }
+        }
+        if (pool.active == 0) {
+            break;
+        }
+
+        // Picks up the ones that finished.
+        taskWait(&pool, &waitMask);
+    }
+
+    releaseInterrupt(&savedInt);
+    releaseStop(&savedStop);
+    free(pool.running);
+
+    if (interrupted) {
+        return 130;
+    }
+    int failed = pool.failed + pool.notStarted;
+    return (failed > 101) ? 101 : failed;
+}
+
+
+/* Reads everything from fd into a buffer that grows as needed, with room for a NUL after it.
+   Returns the buffer with its length in *len, or NULL after printing the error. */
+char* readAll(int fd, size_t *len) {
+    size_t size = 65536;
+    ssize_t got;
+    char *buffer = malloc(size);
+    *len = 0;
+    while (buffer != NULL && (got = read(fd, buffer + *len, size - *len - 1)) != 0) {
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            perror("xargs: read()");
+            free(buffer);
+            return NULL;
+        }
+        *len += got;
+        if (*len + 1 == size) {
+            size *= 2;
+            char *bigger = realloc(buffer, size);
+            if (bigger == NULL) {
+                free(buffer);
+            }
+            buffer = bigger;
+        }
+    }
+    if (buffer == NULL) {
+        perror("xargs: malloc()");
+        return NULL;
+    }
+    buffer[*len] = '\0';
+    return buffer;
+}
+
+
+/* Built in xargs: "xargs [-0] [-n N] [-P N] [-a file] [command [words...]]" runs the command
+   (echo if there isn't one) with the items read from stdin, or the file given with -a, added
+   after its words. Items are separated by blanks and newlines, or with -0 by NULs. Each run
+   gets as many items as fit in ARG_MAX next to the environment, or at most N with -n, so a
+   long list takes a handful of processes instead of one per item. With -P N up to N of them
+   run at once. Exits with 0, 123 if any run failed, 127 if the command couldn't be started or
+   130 if CTRL^C stopped it. */
+int xargsCMD(char *args[], int lastStatus) {
+    const char *usage = "xargs: usage: xargs [-0] [-n N] [-P N] [-a file] [command [words...]]\n";
+    long perRun = 0, limit = 1;
+    const char *file = NULL;
+    int nul = 0, first = 1;
+
+    // Options can have their value in the same word or the next one.
+    while (args[first] != NULL && args[first][0] == '-' && args[first][1] != '\0') {
+        char option = args[first][1];
+        const char *value = NULL;
+        if (option == '0' && args[first][2] == '\0') {
+            nul = 1;
+            first++;
+            continue;
+        }
+        if (option == 'n' || option == 'P' || option == 'a') {
+            value = (args[first][2] != '\0') ? args[first] + 2 : args[first + 1];
+            first += (args[first][2] != '\0') ? 1 : 2;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+        if (option == 'n') {
+            perRun = atol(value);
+        } else if (option == 'P') {
+            limit = atol(value);
+        } else {
+            file = value;
+        }
+        if ((option == 'n' && perRun < 1) || (option == 'P' && limit < 1)) {
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+
+    int inputFD = 0;
+    if (file != NULL && (inputFD = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(file);
+        return 1;
+    }
+    size_t len;
+    char *text = readAll(inputFD, &len);
+    if (inputFD != 0) {
+        close(inputFD);
+    }
+    if (text == NULL) {
+        return 1;
+    }
+
+    // Splits the text into items in place.
+    size_t count = 0, size = 1024, i;
+    char **items = malloc(size * sizeof(char*)), *p = text, *end = text + len;
+    while (items != NULL && p < end) {
+        char *start = p;
+        if (nul) {
+            p += strlen(p) + 1;
+        } else {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')) {
+                p++;
+            }
+            start = p;
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\n') {
+                p++;
+            }
+            if (p == start) {
+                break;
+            }
+            *p++ = '\0';
+        }
+        if (count == size) {
+            size *= 2;
+            char **bigger = realloc(items, size * sizeof(char*));
+            if (bigger == NULL) {
+                free(items);
+            }
+            items = bigger;
+        }
+        if (items != NULL) {
+            items[count++] = start;
+        }
+    }
+    if (items == NULL) {
+        perror("xargs: malloc()");
+        exit(1);
+    }
+
+    // What's left of ARG_MAX for the items once the environment, the command's own words and
+    // the 2048 bytes POSIX asks to be kept free are taken out. Each item costs its chars, a NUL
+    // and a pointer.
+    static char *echoArgs[] = { "echo", NULL };
+    char **base = (args[first] != NULL) ? args + first : echoArgs;
+    int words = 0;
+    long budget = sysconf(_SC_ARG_MAX) - 2048;
+    variablesExport();
+    for (i = 0; environ[i] != NULL; i++) {
+        budget -= strlen(environ[i]) + 1 + sizeof(char*);
+    }
+    for (; base[words] != NULL; words++) {
+        budget -= strlen(base[words]) + 1 + sizeof(char*);
+    }
+
+    char **argv = malloc((words + count + 1) * sizeof(char*));
+    if (argv == NULL) {
+        perror("xargs: malloc()");
+        exit(1);
+    }
+    memcpy(argv, base, words * sizeof(char*));
+
+    struct taskPool pool;
+    struct sigaction savedStop, savedInt;
+    sigset_t waitMask;
+    size_t next = 0;
+    taskPoolInit(&pool, limit);
+    holdStop(&savedStop);
+    catchInterrupt(&savedInt, &waitMask);
+    fflush(stdout);
+
+    // With no items the command still runs once, like it does for xargs.
+    int runs = 0;
+    while (1) {
+        while (pool.active < pool.limit && (next < count || runs == 0) && !interrupted && pool.notStarted == 0) {
+            // Packs items in until the next one wouldn't fit, though there's always at least one.
+            long used = 0;
+            int n = 0;
+            while (next < count && (perRun == 0 || n < perRun)) {
+                long cost = strlen(items[next]) + 1 + sizeof(char*);
+                if (n > 0 && used + cost > budget) {
+                    break;
+                }
+                argv[words + n++] = items[next++];
+                used += cost;
+            }
+            argv[words + n] = NULL;
+            runs++;
+
+            // Only the command and how many items it got are kept, not every item.
+            char *command = joinArgs(base, 1), *listed = malloc(strlen(command) + 32);
+            if (listed == NULL) {
+                perror("xargs: malloc()");
+                exit(1);
+            }
+            sprintf(listed, "%s ... (%d items)", command, n);
+            free(command);
+            taskStart(&pool, argv, listed);
+        }
+        if (pool.active == 0) {
+            break;
+        }
+        taskWait(&pool, &waitMask);
+    }
+
+    releaseInterrupt(&savedInt);
+    releaseStop(&savedStop);
+    free(pool.running);
+    free(argv);
+    free(items);
+    free(text);
+
+    if (interrupted) {
+        return 130;
+    }
+    if (pool.notStarted > 0) {
+        return 127;
+    }
+    return (pool.failed > 0) ? 123 : 0;
+}
+
+
+/* Built in command, prints the status of the last foreground process. */
+int statusCMD(char *args[], int lastStatus) {
+    status(lastStatus);
+    return 0;
+}
+
+
+/* A command the shell runs itself. run is given the arguments and the last foreground status,
+   and returns the command's exit value. */
+struct builtin {
+    const char *name;
+    int (*run)(char *args[], int lastStatus);
+    // 1 for the commands that work on the shell itself, which always run in the shell. 0 for the
+    // ones standing in for a program, which only run in the shell in the foreground and, unless
+    // pipeTail is set, outside a pipeline.
+    int special;
+    // 1 if the exit value becomes the status, like a program's would.
+    int setsStatus;
+    // 1 if it also runs in the shell as the last stage of a foreground pipeline, reading the pipe
+    // as its stdin.
+    int pipeTail;
+};
+
+struct builtin builtins[] = {
+    { "exit", exitCMD, 1, 0, 0 },
+    { "status", statusCMD, 1, 0, 0 },
+    { "cd", cd, 1, 0, 0 },
+    { "hash", hashCMD, 1, 0, 0 },
+    { "export", exportCMD, 1, 1, 0 },
+    { "unset", unsetCMD, 1, 1, 0 },
+    { "jobs", jobsCMD, 1, 1, 0 },
+    { "stats", statsCMD, 1, 1, 0 },
+    { "wait", waitCMD, 1, 1, 0 },
+    { "parallel", parallelCMD, 1, 1, 0 },
+    { "echo", echoCMD, 0, 1, 0 },
+    { "true", trueCMD, 0, 1, 0 },
+    { "false", falseCMD, 0, 1, 0 },
+    { "test", testCMD, 0, 1, 0 },
+    { "[", testCMD, 0, 1, 0 },
+    { "pwd", pwdCMD, 0, 1, 0 },
+    { "printf", printfCMD, 0, 1, 0 },
+    { "kill", killCMD, 0, 1, 0 },
+    { "xargs", xargsCMD, 0, 1, 1 },
+};
+
+
+/* Finds the builtin with exactly this name, or NULL if the command isn't one. */
+struct builtin* findBuiltin(const char *name) {
+    int i;
+    for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+
+/* Runs a builtin with inputFD and outputFD, when they aren't -1, as the shell's own stdin and
+   stdout. Those are moved aside to close-on-exec fds while the builtin runs and put back after,
+   and the builtin's exit value is returned. */
+int runRedirected(struct builtin *b, char *args[], int inputFD, int outputFD, int lastStatus) {
+
+    // What the shell printed before goes to its own stdout, not the file.
+    int savedIn = -1, savedOut = -1;
+    if (inputFD != -1) {
+        savedIn = fcntl(0, F_DUPFD_CLOEXEC, 10);
+        dup2(inputFD, 0);
+    }
+    if (outputFD != -1) {
+        fflush(stdout);
+        savedOut = fcntl(1, F_DUPFD_CLOEXEC, 10);
+        dup2(outputFD, 1);
+    }
+
+    int result = b->run(args, lastStatus);
+
+    // A stdin or stdout the shell didn't have is closed again.
+    if (inputFD != -1) {
+        if (savedIn != -1) {
+            dup2(savedIn, 0);
+            close(savedIn);
+        } else {
+            close(0);
+        }
+    }
+    if (outputFD != -1) {
+        fflush(stdout);
+        if (savedOut != -1) {
+            dup2(savedOut, 1);
+            close(savedOut);
+        } else {
+            close(1);
+        }
+    }
+    return result;
+}
+
+
+/* Runs a builtin in the shell without starting a process, with "<" and ">" applied to the shell's
+   own stdin and stdout. */
+void runBuiltin(struct builtin *b, char *args[], const char *inputFile, const char *outputFile, int *exitStatus) {
+    int inputFD = -1, outputFD = -1, failed = 0;
+
+    if (inputFile != NULL) {
+        inputFD = openRedirect(inputFile, O_RDONLY, "input open() fg");
+        failed |= (inputFD == -1);
+    }
+    if (outputFile != NULL && !failed) {
+        outputFD = openRedirect(outputFile, O_WRONLY | O_CREAT | O_TRUNC, "output open() fg");
+        failed |= (outputFD == -1);
+    }
+
+    // The same status as a command that couldn't open the file.
+    if (failed) {
+        if (inputFD != -1) {
+            close(inputFD);
+        }
+        if (b->setsStatus) {
+            *exitStatus = W_EXITCODE(1, 0);
+        }
+        return;
+    }
+
+    int result = runRedirected(b, args, inputFD, outputFD, *exitStatus);
+    if (inputFD != -1) {
+        close(inputFD);
+    }
+    if (outputFD != -1) {
+        close(outputFD);
+    }
+
+    if (b->setsStatus) {
+        *exitStatus = W_EXITCODE(result, 0);
+    }
+}
 
-    // Gets the command line length, if len is 3, then the user input was just "cd\0", otherwise there are two arguments.
-    int len = strlen(line);
 
-    if (len == 3) {
+// Chars that mean something in a pattern, and get a \ in front of them when they're quoted.
+#define GLOB_CHAR(c) ((c) == '*' || (c) == '?' || (c) == '[' || (c) == ']' || (c) == '\\')
 
-        // Changes the directory to the home environment.
-        if (chdir(getenv("HOME")) < 0) {
-            perror("chdir()");
-        } 
-        
-    } else {
-        // Removing the first command "cd".
-        char *newPath = strtok(line, " \n");
+// The shell's pid as text, for "$$".
+char pidString[16];
+int pidLength = 0;
+
+/* Memory the current command line is split up into: the words, and the argument list pointing at
+   them. It's kept from one command line to the next and only ever grows, so splitting up a line
+   doesn't allocate once the shell has seen a line that long. */
+struct arena {
+    char *words;
+    char **args;
+    // For each argument, 1 if it's a pattern to expand, and after expanding 1 + how many names it matched.
+    size_t *patterns;
+    size_t wordsSize, argsSize;
+    // How many of the first arguments are NAME=value assignments.
+    int assignments;
+};
+
+struct arena arena = { NULL, NULL, NULL, 0, 0, 0 };
 
-        // Getting the second token of the command line which will be the desired path.
-        newPath = strtok(NULL, " \n");
-        
-        if (chdir(newPath) < 0) {
-            perror("chdir()");
-        } 
 
+/* Makes sure the arena has room for this many chars of words and this many arguments. */
+void arenaReserve(size_t words, size_t args) {
+    if (words > arena.wordsSize) {
+        arena.wordsSize = (words > arena.wordsSize * 2) ? words : arena.wordsSize * 2;
+        free(arena.words);
+        arena.words = malloc(arena.wordsSize);
+    }
+    if (args > arena.argsSize) {
+        arena.argsSize = (args > arena.argsSize * 2) ? args : arena.argsSize * 2;
+        free(arena.args);
+        free(arena.patterns);
+        arena.args = malloc(arena.argsSize * sizeof(char*));
+        arena.patterns = malloc(arena.argsSize * sizeof(size_t));
+    }
+    if (arena.words == NULL || arena.args == NULL || arena.patterns == NULL) {
+        perror("malloc()");
+        exit(1);
     }
 }
 
 
-/* Built in command, prints the exit status or termination signal of the last
-   foreground process ran, used/modified from lectures.*/
-void status(int status) {
+// Size of the buffer directories are read into with getdents64(), a few thousand names at a time.
+#define GLOB_BUFFER (256 * 1024)
 
-    // Exited normally.
-    if (WIFEXITED(status)) {
-        printf("exit value %d\n", WEXITSTATUS(status));
+/* The names patterns expanded to, kept like the arena from one command line to the next. The
+   names are one after another in names, and start at the offsets in matches. Both grow as
+   needed, so names are found by offset until every pattern on the line is done. The argument
+   list they end up in is expanded, which replaces the arena's for a line with patterns. */
+struct globResults {
+    char *names;
+    size_t namesSize, namesUsed;
+    size_t *matches;
+    size_t matchesSize, matchesUsed;
+    char **expanded;
+    size_t expandedSize;
+};
 
-    // Exited via signal.
-    } else {
-        printf("terminated by signal %d\n", WTERMSIG(status));
+struct globResults globbed = { NULL, 0, 0, NULL, 0, 0, NULL, 0 };
+
+
+/* Grows a buffer of count things of size bytes to hold at least needed. */
+void* globGrow(void *buffer, size_t *count, size_t needed, size_t size) {
+    if (needed <= *count) {
+        return buffer;
+    }
+    *count = (needed > *count * 2) ? needed : *count * 2;
+    buffer = realloc(buffer, *count * size);
+    if (buffer == NULL) {
+        perror("realloc()");
+        exit(1);
     }
+    return buffer;
 }
 
 
-/* Built in command, exits the program and terminates the processes. */
-void exitCMD(int pidArray[]) {
+/* Adds a name a pattern matched to the results. */
+void globAdd(const char *path, size_t len) {
+    globbed.names = globGrow(globbed.names, &globbed.namesSize, globbed.namesUsed + len + 1, 1);
+    globbed.matches = globGrow(globbed.matches, &globbed.matchesSize, globbed.matchesUsed + 1, sizeof(size_t));
+    memcpy(globbed.names + globbed.namesUsed, path, len);
+    globbed.names[globbed.namesUsed + len] = '\0';
+    globbed.matches[globbed.matchesUsed++] = globbed.namesUsed;
+    globbed.namesUsed += len + 1;
+}
 
-    int i;
-    for (i = 0; i < 1000; i++) {
-        // If there is a PID value in the index, attempts to kill it if it's not terminated already.
-        if (pidArray[i] > -1) {
-            kill(pidArray[i], SIGKILL);
-        }
+
+/* Checks c against the pattern element at p: "?", "[...]", "\x" or a plain char. Returns how many
+   chars of the pattern the element takes up if c matches it, 0 if it doesn't. */
+int globOne(const char *p, char c) {
+    if (*p == '?') {
+        return 1;
     }
+    if (*p == '\\' && p[1] != '\0') {
+        return (p[1] == c) ? 2 : 0;
+    }
+    if (*p != '[') {
+        return (*p == c) ? 1 : 0;
+    }
+
+    // A class, "!" or "^" first turns it around, and a "]" first is one of its chars.
+    const char *q = p + 1;
+    int negate = (*q == '!' || *q == '^'), found = 0;
+    q += negate;
+    do {
+        char low = *q, high;
+        if (low == '\\' && q[1] != '\0') {
+            low = *++q;
+        }
+        high = low;
+        if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+            high = q[2];
+            q += 2;
+            if (high == '\\' && q[1] != '\0') {
+                high = *++q;
+            }
+        }
+        found |= (low <= c && c <= high);
+        q++;
+    } while (*q != ']' && *q != '\0');
 
-    exit(2);
+    // Without a "]" to end it, the "[" is just a "[".
+    if (*q == '\0') {
+        return (c == '[') ? 1 : 0;
+    }
+    return (found != negate) ? (int) (q - p + 1) : 0;
 }
 
 
-/* Checks for expansion of the command line.*/
-void expandInput(char input[]) {
+/* Matches a name against a pattern for one path component. A "*" that fails to match further on
+   only ever goes back to the last "*" and tries one char further, never to earlier ones, so a
+   match takes at most the length of the name times the length of the pattern steps and can't
+   blow up the way backtracking into every "*" can. */
+int globMatch(const char *pattern, const char *name) {
+    const char *p = pattern, *n = name, *starP = NULL, *starN = NULL;
+    int step;
 
-    /* Get the PID from smallsh and convert it to string format.*/
-    char pid_str[10];
-    int pid = getpid();
-    sprintf(pid_str, "%d", pid);
+    while (*n != '\0') {
+        if (*p == '*') {
+            starP = ++p;
+            starN = n;
+        } else if (*p != '\0' && (step = globOne(p, *n)) > 0) {
+            p += step;
+            n++;
+        } else if (starP != NULL) {
+            p = starP;
+            n = ++starN;
+        } else {
+            return 0;
+        }
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
 
-    // Getting the length of the PID in string format.
-    int pid_len = strlen(pid_str);
 
-    int i;
-    int count = 0;
+/* Whether a pattern has anything to match with: a "*", a "?" or a "[" with a "]" after it. */
+int globHasMeta(const char *pattern) {
+    const char *p;
+    for (p = pattern; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    /* Finding the instances of $ so we can calculate how much theoretical
-        space we need to add to a new buffer to expand "$$". */
 
-    // Getting the count of $ instances in the command line.
-    for (i = 0; i < strlen(input)-1; i++) {
-        if (input[i] == '$') {
-            count++;
+/* Takes the backslashes out of a word that was kept as a pattern, in place. */
+void globUnescape(char *word) {
+    char *out = word;
+    for (; *word != '\0'; word++) {
+        if (*word == '\\' && word[1] != '\0') {
+            word++;
         }
+        *out++ = *word;
     }
+    *out = '\0';
+}
 
-    // Checks to see if an expansion is needed.
-    if (count > 1) {
 
-        // Length of command line.
-        int inputLen = strlen(input);
+/* Whether path (which has room after it) is a directory, checking with stat() only when the
+   directory entry didn't say. */
+int globIsDir(const char *path, unsigned char type) {
+    struct stat info;
+    if (type != DT_UNKNOWN && type != DT_LNK) {
+        return type == DT_DIR;
+    }
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
 
-        // The pid number is replace two instances of "$", so for every "$$", we allocate enough space for one string of pid.
-        int newCount = (count/2);
-        int len = (newCount * pid_len);
 
-        // The final input after expansion is the original input length plus the instances of "$$" being replaced.
-        int bufferLen = (len + inputLen + 1);
+/* Adds every path matching pattern to the results. path holds the len chars of the directories
+   matched so far, ending in "/" (or nothing for the current directory), and pattern is what's
+   left of the pattern after them. A component without anything to match with is added to the
+   path as it is, only the ones with "*", "?" or "[...]" read the directory. The directory is read
+   with getdents64() into a large buffer, and the file type that comes with each name means the
+   names in it don't have to be stat()ed. */
+void globWalk(char path[], size_t len, const char *pattern) {
+    char component[NAME_MAX * 2 + 2];
+    const char *slash = strchr(pattern, '/'), *rest = NULL;
+    size_t size = (slash != NULL) ? (size_t) (slash - pattern) : strlen(pattern);
+    if (size >= sizeof(component)) {
+        return;
+    }
+    memcpy(component, pattern, size);
+    component[size] = '\0';
+    if (slash != NULL) {
+        for (rest = slash; *rest == '/'; rest++);
+    }
 
-        // This is the new temp input buffer.
-        char inputBuffer[bufferLen];
-        int j;
-        int k = 0;
-        int s;
+    // A plain component just has to be there. Whatever comes after it is found in it, and a "/"
+    // at the end of the pattern only matches directories.
+    if (!globHasMeta(component)) {
+        globUnescape(component);
+        size = strlen(component);
+        if (len + size + 2 >= PATH_MAX) {
+            return;
+        }
+        memcpy(path + len, component, size + 1);
+        if (rest != NULL && *rest != '\0') {
+            path[len + size] = '/';
+            globWalk(path, len + size + 1, rest);
+        } else if (rest != NULL) {
+            if (globIsDir(path, DT_UNKNOWN)) {
+                path[len + size] = '/';
+                globAdd(path, len + size + 1);
+            }
+        } else if (access(path, F_OK) == 0 || errno != ENOENT) {
+            globAdd(path, len + size);
+        }
+        return;
+    }
+
+    path[len] = '\0';
+    int dirFD = open(len == 0 ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFD < 0) {
+        return;
+    }
+    char *buffer = malloc(GLOB_BUFFER);
+    if (buffer == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
 
-        for (j = 0; j < inputLen-1; j++) {
+    ssize_t got;
+    while ((got = getdents64(dirFD, buffer, GLOB_BUFFER)) > 0) {
+        ssize_t at;
+        for (at = 0; at < got; at += ((struct dirent64 *) (buffer + at))->d_reclen) {
+            struct dirent64 *entry = (struct dirent64 *) (buffer + at);
+            const char *name = entry->d_name;
 
-            /* If we find back to back instances of "$", then we replace them with the pid number.
-                we do an extra increment of the input string/command line so we don't double visit
-                the second '$' in "$$". */
-            if (input[j] == '$' && input[j+1] == '$') {
+            // "." and ".." are never matched, and other names starting with "." only by a
+            // pattern that starts with one too.
+            if (name[0] == '.' && (component[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (!globMatch(component, name)) {
+                continue;
+            }
 
-                // Advances the input buffer and sets the char to be a char from the pid array.
-                for (s = 0; s < pid_len; s++) {
-                    inputBuffer[k] = pid_str[s];
-                    k++;
+            size = strlen(name);
+            if (len + size + 2 >= PATH_MAX) {
+                continue;
+            }
+            memcpy(path + len, name, size + 1);
+            if (rest == NULL) {
+                globAdd(path, len + size);
+            } else if (globIsDir(path, entry->d_type)) {
+                path[len + size] = '/';
+                if (*rest == '\0') {
+                    globAdd(path, len + size + 1);
+                } else {
+                    globWalk(path, len + size + 1, rest);
                 }
-                j++;
+            }
+        }
+    }
 
-                // Reset the pointer of pid array incase there are multiple instances of "$$".
-                s = 0;
+    free(buffer);
+    close(dirFD);
+}
 
-            // Sets the input buffer char to be the input char and moves on.
-            } else {
-                inputBuffer[k] = input[j];
-                k++;
-            }
 
+/* Orders two names in the results by their offsets. */
+int globOrder(const void *a, const void *b) {
+    return strcmp(globbed.names + *(const size_t*) a, globbed.names + *(const size_t*) b);
+}
+
+
+/* Replaces the patterns in an argument list of count entries (the ones marked in arena.patterns)
+   with the names they match, sorted, and sets *args to the new list. A pattern that matches
+   nothing is kept as it is, like in sh. */
+void expandGlobs(char **args[], size_t count) {
+    char path[PATH_MAX];
+    size_t i, total = 0, next = 0;
+
+    globbed.namesUsed = 0;
+    globbed.matchesUsed = 0;
+    for (i = 0; i < count; i++) {
+        if (arena.patterns[i] == 0) {
+            total++;
+            continue;
         }
 
-        // Makes sure to end the input buffer with the NULL terminator.
-        inputBuffer[k] = '\0';
+        size_t first = globbed.matchesUsed;
+        const char *pattern = arena.args[i];
+        size_t start = 0;
+        if (pattern[0] == '/') {
+            path[0] = '/';
+            start = 1;
+            while (*pattern == '/') {
+                pattern++;
+            }
+        }
+        globWalk(path, start, pattern);
 
-        // Copies the contents from the input buffer to the orignal input with everything expanded.
-        strcpy(input, inputBuffer);
-    } 
+        size_t found = globbed.matchesUsed - first;
+        qsort(globbed.matches + first, found, sizeof(size_t), globOrder);
+        arena.patterns[i] = found + 1;
+        total += (found > 0) ? found : 1;
+    }
 
+    // The names don't move anymore, so the new list can point at them.
+    globbed.expanded = globGrow(globbed.expanded, &globbed.expandedSize, total + 1, sizeof(char*));
+    total = 0;
+    for (i = 0; i < count; i++) {
+        size_t found = (arena.patterns[i] > 0) ? arena.patterns[i] - 1 : 0;
+        if (found == 0) {
+            if (arena.patterns[i] == 1) {
+                globUnescape(arena.args[i]);
+            }
+            globbed.expanded[total++] = arena.args[i];
+        }
+        for (; found > 0; found--) {
+            globbed.expanded[total++] = globbed.names + globbed.matches[next++];
+        }
+    }
+    globbed.expanded[total] = NULL;
+    *args = globbed.expanded;
 }
 
 
-/* Executes a command via fork, exe and waitpid. */
-void exeCMD(char *args[], int bg, char inputFile[], char outputFile[], struct sigaction SIGINT_action, struct sigaction SIGTSTP_action, int* exitStatus, int pidArray[], int *count) {
-    
+// The status of the last foreground command, for "$?".
+int lastExitStatus = 0;
 
-    /* Fork a child process, similar to the lectures from class Excuting A New Program. */
-    int childStatus;
-    pid_t spawnPid = fork();
+// The most room n chars of a command line can take up as words: every char doubled by a \ in
+// front of it, every "$$" growing into the pid and a NUL after each word, of which there can be
+// one for every two chars.
+#define LINE_ROOM(n) (2 * (n) + ((n) / 2 + 1) * (pidLength + 1) + 1)
+
+/* Where parseInput() is in splitting up a line. Everything pointing into the words is kept here,
+   so they can be moved when an expansion needs more room than the line was given. */
+struct lexer {
+    // Where the next char of the words goes, and where the current word starts.
+    char *out, *word;
+    char **argv;
+    int count, stages, patterns;
+    // Where the next word goes when it follows "<" or ">", and the last "&" seen.
+    char **target, *ampersand;
+    char **inputFile, **outputFile;
+    // The current word: some of it was quoted, quoted pattern chars have a \ in front of them,
+    // it has pattern chars outside quotes (a "[" for a "]" to close), some of it came from an
+    // expansion, an expansion split it into more than one, and it's a NAME=value.
+    int quoted, escaped, meta, bracket, expanded, split, assignment;
+    // 1 while every word of the stage so far has been an assignment.
+    int assigning;
+};
+
+
+/* Makes sure there's room for size more chars of words, moving them when the arena has to grow. */
+void lexRoom(struct lexer *l, size_t size) {
+    size_t used = l->out - arena.words;
+    if (used + size <= arena.wordsSize) {
+        return;
+    }
 
-    switch(spawnPid) {
-    case -1:
-        perror("fork()\n");
+    char *old = arena.words;
+    arena.wordsSize = (used + size > arena.wordsSize * 2) ? used + size : arena.wordsSize * 2;
+    arena.words = malloc(arena.wordsSize);
+    if (arena.words == NULL) {
+        perror("malloc()");
         exit(1);
-        break;
+    }
+    memcpy(arena.words, old, used);
 
-    // Child process is successfull for now.
-    case 0:
+    // Everything pointing at the old words points at the same place in the new ones.
+    int i;
+    for (i = 0; i < l->count; i++) {
+        if (l->argv[i] != NULL) {
+            l->argv[i] = arena.words + (l->argv[i] - old);
+        }
+    }
+    if (l->ampersand != NULL) {
+        l->ampersand = arena.words + (l->ampersand - old);
+    }
+    if (*l->inputFile != NULL) {
+        *l->inputFile = arena.words + (*l->inputFile - old);
+    }
+    if (*l->outputFile != NULL) {
+        *l->outputFile = arena.words + (*l->outputFile - old);
+    }
+    l->word = arena.words + (l->word - old);
+    l->out = arena.words + used;
+    free(old);
+}
 
-        // Child proceses ignore ctrl^z.
-        SIGTSTP_action.sa_handler = SIG_IGN;
-        sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
-        if (bg == 1) {
+/* Adds an argument (or the NULL ending a stage), growing the argument list when expansions have
+   made more of them than the line had room for. */
+void lexArg(struct lexer *l, char *arg, int pattern) {
+    if (l->count + 2 > arena.argsSize) {
+        arena.argsSize *= 2;
+        arena.args = realloc(arena.args, arena.argsSize * sizeof(char*));
+        arena.patterns = realloc(arena.patterns, arena.argsSize * sizeof(size_t));
+        if (arena.args == NULL || arena.patterns == NULL) {
+            perror("realloc()");
+            exit(1);
+        }
+        l->argv = arena.args;
+    }
+    arena.patterns[l->count] = pattern;
+    l->patterns += pattern;
+    l->argv[l->count++] = arg;
+}
 
-            // Cancel/Interrupt forground process when us CTRL^C.
-            SIGINT_action.sa_handler = SIG_DFL;
-            sigaction(SIGINT, &SIGINT_action, NULL);
- 
-        } else if (bg == 0) {
 
-            // Background processes ignore CTRL^C.
-            SIGINT_action.sa_handler = SIG_IGN;
-            sigaction(SIGINT, &SIGINT_action, NULL);
+/* Copies what an expansion expanded to into the current word. Quoted, or in an assignment, it's
+   kept whole with a \ in front of its pattern chars, like anything quoted. Otherwise blanks split
+   it up, marked with a NUL for lexFinish() to split the word at, and its pattern chars work like
+   ones typed in. rest is how much of the line is left, which still needs its room after it.
+   value can be in the arena after the word, as long as the chars that get a \ in front of them
+   fit between the two and the room is already there (see lexSubstitute()). */
+void lexValue(struct lexer *l, const char *value, size_t n, int quoted, size_t rest) {
+    lexRoom(l, 2 * n + LINE_ROOM(rest));
+    l->expanded = 1;
+    for (; n > 0; n--, value++) {
+        char c = *value;
+        if (!quoted && (c == ' ' || c == '\t' || c == '\n')) {
+            // Blanks in a row, or at the start of the word, only split it once.
+            if (l->out > l->word && l->out[-1] != '\0') {
+                *l->out++ = '\0';
+                l->split = 1;
+            }
+            continue;
+        }
+        if (GLOB_CHAR(c) && (quoted || c == '\\')) {
+            *l->out++ = '\\';
+            l->escaped = 1;
+        } else if (!quoted) {
+            l->meta |= (c == '*' || c == '?' || (c == ']' && l->bracket));
+            l->bracket |= (c == '[');
         }
-        
+        *l->out++ = c;
+    }
+}
 
-        // If the inputfile has changed its starting string, need to parse inputfile.
-        if (strcmp(inputFile, "standard") != 0) {
-            
-            // Checks to see if the command is ran in the background. Redirects to "/dev/null" if so.
-            if (bg == 0) {
 
-                int inputFD = open("/dev/null", O_RDONLY);
-                if (inputFD == -1) {
-                    perror("input open() bg");
-                    exit(1);    
-                }
+// The status of the last "$(...)" on the line, which "$?" after it expands to and which is the
+// status of a line that only assigns variables.
+int substitutionStatus = 0;
 
-            /* Regular foreground redirection with dup2()
-                Modified from lectures Processes and I/O */
-            } else {
-                
-                int inputFD = open(inputFile, O_RDONLY);
-                if (inputFD == -1) {
-                    perror("input open() fg");
-                    exit(1);    
-                }
+void runSubshell(const char *text, size_t len);
 
-                int result = dup2(inputFD, 0);
-                if (result == -1) {
-                    perror("input dup2() fg");
-                    exit(2);
-                }
+/* Expands the "$(" at p. The command inside is run by runSubshell() in a copy of the shell made
+   with fork(), so it sees every variable and builtin, with its stdout going into a pipe. What it
+   writes is read straight into the arena after the word, in reads as large as the room there,
+   then lexValue() moves it into the word in place, split into words when it isn't quoted, with
+   the trailing newlines dropped. Returns where the line goes on after the ")", or NULL after
+   saying why if there isn't one or the command can't be started. */
+const char* lexSubstitute(struct lexer *l, const char *p, const char *end, int quoted) {
+    // Finds the ")" that closes it, over quotes and any "(...)" inside.
+    const char *s = p + 2, *paren;
+    int depth = 1;
+    for (paren = s; paren < end; paren++) {
+        if (*paren == '\\') {
+            paren++;
+        } else if (*paren == '\'') {
+            const char *q = memchr(paren + 1, '\'', end - paren - 1);
+            paren = (q != NULL) ? q : end;
+        } else if (*paren == '"') {
+            for (paren++; paren < end && *paren != '"'; paren++) {
+                paren += (*paren == '\\');
             }
+        } else if (*paren == '(') {
+            depth++;
+        } else if (*paren == ')' && --depth == 0) {
+            break;
         }
+    }
+    if (paren >= end) {
+        fprintf(stderr, "smallsh: missing ) after $(\n");
+        return NULL;
+    }
 
-        // If the outputfile has changed its starting string, need to parse the outputfile.
-        if (strcmp(outputFile, "standard") != 0) {
-            
-            // Checks to see if the command is ran in the background. Redirects to "/dev/null" if so.
-            if (bg == 0) {
+    // Nothing the shell has buffered may come out twice, once from each copy.
+    fflush(stdout);
+    if (trace != NULL) {
+        fflush(trace);
+    }
+    int pipeFDs[2];
+    if (pipe2(pipeFDs, O_CLOEXEC) < 0) {
+        perror("pipe2()");
+        return NULL;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork()");
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        dup2(pipeFDs[1], 1);
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+        runSubshell(s, paren - s);
+    }
+    close(pipeFDs[1]);
 
-                int outputFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (outputFD == -1) {
-                    perror("output open() bg");
-                    exit(1);
-                }
+    // The output goes after what's in the words so far, l->out is moved past it while the arena
+    // grows so lexRoom() keeps it.
+    size_t start = l->out - arena.words, used = 0;
+    ssize_t n = 1;
+    while (n != 0) {
+        l->out = arena.words + start + used;
+        lexRoom(l, (used > 65536) ? used : 65536);
+        n = read(pipeFDs[0], l->out, arena.wordsSize - start - used);
+        if (n > 0) {
+            used += n;
+        } else if (n < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    close(pipeFDs[0]);
+    waitpid(pid, &substitutionStatus, 0);
+    lastExitStatus = substitutionStatus;
 
-            /* Regular foreground redirection with dup2()
-                Modified from lectures Processes and I/O */
-            } else {
-                
-                int outputFD = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (outputFD == -1) {
-                    perror("output open() fg");
-                    exit(1);
-                }
-                
-                int result2 = dup2(outputFD, 1);
-                if (result2 == -1) {
-                    perror("output dup2() fg");
-                    exit(2);
-                }
-            }
+    while (used > 0 && arena.words[start + used - 1] == '\n') {
+        used--;
+    }
+
+    // Every char that gets a \\ in front of it makes the output one longer. It's moved up by that
+    // much, so copying it into the word from the front never writes over a char not read yet,
+    // with the room lexValue() wants there already so the words don't move under it.
+    size_t escapes = 0, i;
+    char *output = arena.words + start;
+    for (i = 0; i < used; i++) {
+        escapes += (GLOB_CHAR(output[i]) && (quoted || output[i] == '\\'));
+    }
+    l->out = output + used;
+    lexRoom(l, used + LINE_ROOM(end - paren - 1));
+    output = arena.words + start;
+    memmove(output + escapes, output, used);
+    l->out = output;
+    lexValue(l, output + escapes, used, quoted, end - paren - 1);
+    l->expanded = 1;
+    return paren + 1;
+}
+
+
+/* Expands the "$" at p: "$$" to the shell's pid, "$?" to the last status, "$!" to the pid of the
+   last background job, "$NAME" or "${NAME}" to a variable's value (nothing if it isn't set) and
+   "$(command)" to what the command writes (see lexSubstitute()). Returns where the line goes on
+   after it, p itself for a "$" that's just a "$", or NULL after saying why if it isn't right. */
+const char* lexExpand(struct lexer *l, const char *p, const char *end, int quoted) {
+    const char *s = p + 1, *value = NULL;
+    char number[16];
+
+    if (s >= end) {
+        return p;
+    }
+
+    // The pid always fits in the room the line was given.
+    if (*s == '$') {
+        memcpy(l->out, pidString, pidLength);
+        l->out += pidLength;
+        return s + 1;
+    }
+
+    if (*s == '(') {
+        return lexSubstitute(l, p, end, quoted);
+    }
+
+    if (*s == '?') {
+        sprintf(number, "%d", exitValue(lastExitStatus));
+        value = number;
+        s++;
+    } else if (*s == '!') {
+        sprintf(number, "%d", lastBackground);
+        value = (lastBackground != 0) ? number : NULL;
+        s++;
+    } else if (*s == '{') {
+        const char *name = s + 1;
+        for (s = name; s < end && (isalnum((unsigned char) *s) || *s == '_'); s++);
+        if (s >= end || *s != '}' || s == name || isdigit((unsigned char) *name)) {
+            fprintf(stderr, "smallsh: bad substitution\n");
+            return NULL;
         }
+        value = variableGet(name, s - name);
+        s++;
+    } else if (isalpha((unsigned char) *s) || *s == '_') {
+        const char *name = s;
+        while (s < end && (isalnum((unsigned char) *s) || *s == '_')) {
+            s++;
+        }
+        value = variableGet(name, s - name);
+    } else {
+        return p;
+    }
 
-        // Executes the new program with the forked child process.
-        execvp(args[0], args);
-        perror("evecvp\n");
-        exit(2);
-        break;
+    l->expanded = 1;
+    if (value != NULL) {
+        lexValue(l, value, strlen(value), quoted, end - s);
+    }
+    return s;
+}
 
-    default:
-        // Checks to see if we want to run the command in the background and if background commands are currently allowed.
-        if (bg == 0 && bgIgnore == 1) {
-            //Adds the child pid to the pidArray.
-            pidArray[*count] = spawnPid;
-            *count = *count + 1;
 
-            //Prints child pid of the background process
-            printf("background pid is %d\n", spawnPid);
-            fflush(stdout);
-            waitpid(spawnPid, &childStatus, WNOHANG);
+/* Puts one word, or one piece of a word an expansion split up, where it goes: the file after a
+   "<" or ">", or the next argument. The \ in front of quoted chars only stays in a pattern.
+   Returns -1 if it's a file name that was split up, 0 otherwise. */
+int lexPlace(struct lexer *l, char *arg, int pattern) {
+    if (l->escaped && !pattern) {
+        globUnescape(arg);
+    }
+    if (l->target != NULL) {
+        if (l->split) {
+            fprintf(stderr, "smallsh: ambiguous redirect\n");
+            return -1;
+        }
+        *l->target = arg;
+        l->target = NULL;
+        return 0;
+    }
+    l->assigning &= l->assignment;
+    arena.assignments += (l->assigning && l->stages == 1);
+    lexArg(l, arg, pattern);
+    return 0;
+}
 
-        // Otherwise we run in the forground.
-        } else {
-            //Adds the child pid to the pidArray.
-            pidArray[*count] = spawnPid;
-            *count = *count + 1;
-	        waitpid(spawnPid, &childStatus, 0);
 
-            // If there is an interuption such as CTRL^C.
-            if (childStatus == 2) {
-                status(childStatus);
+/* Ends the current word and puts it where it goes. Only words without quotes or expansions in them
+   can be "<", ">", "|" or "&". Returns -1 after saying why if it can't go anywhere, 0 otherwise. */
+int lexFinish(struct lexer *l) {
+    char *word = l->word;
+    *l->out++ = '\0';
+
+    // Pattern chars in an assignment are just chars.
+    if (l->assignment) {
+        l->meta = 0;
+    }
+
+    // A word made of nothing but empty expansions isn't there at all, unlike "".
+    if (word[0] == '\0' && !l->quoted) {
+        l->out = word;
+        return 0;
+    }
+
+    // Every piece of a split word is a word of its own, and a pattern only if the piece has
+    // pattern chars that weren't quoted.
+    if (l->split) {
+        char *last = l->out - 1;
+        while (word < last) {
+            size_t n = strlen(word);
+            if (n > 0 && lexPlace(l, word, l->meta && l->target == NULL && globHasMeta(word)) < 0) {
+                return -1;
+            }
+            word += n + 1;
+        }
+        return 0;
+    }
+
+    if (!l->quoted && !l->expanded && l->target == NULL) {
+        // Determining if the word is an input or output redirection, the next word is the file.
+        if (strcmp(word, "<") == 0) {
+            l->target = l->inputFile;
+            return 0;
+        } else if (strcmp(word, ">") == 0) {
+            l->target = l->outputFile;
+            return 0;
+
+        // Ends one stage of a pipeline, the NULL tells exeCMD where the next one starts.
+        } else if (strcmp(word, "|") == 0) {
+            if (l->count > 0 && l->argv[l->count - 1] != NULL) {
+                lexArg(l, NULL, 0);
+                l->stages++;
             }
+            l->assigning = 1;
+            return 0;
 
+        // Remembers an "&" in case it's the last argument.
+        } else if (strcmp(word, "&") == 0) {
+            l->ampersand = word;
         }
     }
+    return lexPlace(l, word, l->meta && l->target == NULL);
+}
 
-    // Keeps checking to see if the background process is done.
-    while ((spawnPid = waitpid(-1, &childStatus, WNOHANG)) > 0) {
-        // Prints child pid of the completed process.
-        printf("background pid %d is done: ", spawnPid);
-        fflush(stdout);
-        // Calls the built-in status function to get the exit status.
-        status(childStatus);
-    } 
 
-    // Updates the exitstatus to be the childstatus.
-    *exitStatus = childStatus;
+/* Splits a command line into arguments in one pass over it, straight into the arena:
+   - Words are separated by spaces, tabs and newlines.
+   - '...' keeps everything inside as it is. "..." does too, except that \", \\ and \$ are
+     escapes and "$" expansions still happen. Outside quotes a \ keeps the next char as it is.
+   - "$$" is replaced by the shell's pid, "$?" by the exit value of the last command, "$!" by
+     the pid of the last background job, "$NAME" or "${NAME}" by the variable's value and
+     "$(command)" by what the command writes. Outside quotes the value is split into words at its
+     blanks, and one that's empty is no word at all.
+   - Words at the start of a command that look like NAME=value are assignments, whose values
+     aren't split up or expanded as patterns.
+   - A word with a "*", "?" or "[...]" outside quotes is a pattern, replaced by the names of the
+     files it matches in sorted order (or kept as it is when nothing does). While the line is
+     split up, quoted chars that mean something in a pattern get a \ in front of them, which comes
+     out again for words that aren't patterns.
+   - "<" and ">" take the next word as the input or output file, "|" ends one stage of a pipeline
+     and a "&" at the end runs the command in the background, but only when they're whole words
+     without quotes, so echo '>' prints ">".
+   args is set to the argument list, with the stages of a pipeline one after another and a NULL
+   after each, and stages to how many there are. inputFile and outputFile point at the file names
+   or are NULL. Everything stays valid until the next call. Returns -1 if the line can't be split
+   up (after saying why), 0 otherwise. */
+int parseInput(const char *input, size_t len, char **args[], int *stages, int *bg, char **inputFile, char **outputFile) {
+    if (pidLength == 0) {
+        pidLength = sprintf(pidString, "%d", getpid());
+    }
 
+    // With the room the line can need there up front, the words only move for an expansion.
+    arenaReserve(LINE_ROOM(len), len / 2 + 3);
+    const char *p = input, *end = input + len;
+    struct lexer l = { arena.words, arena.words, arena.args, 0, 1, 0, NULL, NULL, inputFile, outputFile };
+    l.assigning = 1;
+    arena.assignments = 0;
 
-}
+    *inputFile = NULL;
+    *outputFile = NULL;
+
+    while (1) {
+        // Skips the blanks before the next word.
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')) {
+            p++;
+        }
+        if (p >= end) {
+            break;
+        }
+
+        // The words are written through out, which is only put back in l for the functions
+        // that use it.
+        char *out = l.out;
+        l.word = out;
+        l.quoted = l.escaped = l.meta = l.bracket = l.expanded = l.split = l.assignment = 0;
 
+        // An assignment is a name and a "=", before anything else in the command.
+        if (l.assigning && l.target == NULL && (isalpha((unsigned char) *p) || *p == '_')) {
+            const char *name = p;
+            while (name < end && (isalnum((unsigned char) *name) || *name == '_')) {
+                name++;
+            }
+            l.assignment = (name < end && *name == '=');
+        }
 
-/* Parses the command line input into invidual arguments */
-void parseInput(char input[], char *args[], int *bg, char inputFile[], char outputFile[]) {
-    
-    // Break the command line into singular arguments.
-    char *token = strtok(input, " \n");
-    int i = 0;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\n') {
+            if (*p == '\'') {
+                const char *close = memchr(p + 1, '\'', end - p - 1);
+                if (close == NULL) {
+                    fprintf(stderr, "smallsh: unterminated quote\n");
+                    return -1;
+                }
+                for (p++; p < close; p++) {
+                    if (GLOB_CHAR(*p)) {
+                        *out++ = '\\';
+                        l.escaped = 1;
+                    }
+                    *out++ = *p;
+                }
+                p = close + 1;
+                l.quoted = 1;
 
-    // Need to account for < > eventually.
-    while (token != NULL) {
-        
+            } else if (*p == '"') {
+                p++;
+                while (p < end && *p != '"') {
+                    if (*p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\' || p[1] == '$')) {
+                        p++;
+                    } else if (*p == '$') {
+                        l.out = out;
+                        const char *next = lexExpand(&l, p, end, 1);
+                        out = l.out;
+                        if (next == NULL) {
+                            return -1;
+                        } else if (next != p) {
+                            p = next;
+                            continue;
+                        }
+                    }
+                    if (GLOB_CHAR(*p)) {
+                        *out++ = '\\';
+                        l.escaped = 1;
+                    }
+                    *out++ = *p++;
+                }
+                if (p >= end) {
+                    fprintf(stderr, "smallsh: unterminated quote\n");
+                    return -1;
+                }
+                p++;
+                l.quoted = 1;
 
-        // Determining if the argument(s) is/are input and output files.
-        // This is the case for input files. Copy the token name to be the input file.
-        if (strcmp(token, "<") == 0) {
-            token = strtok(NULL, " \n");
-            strcpy(inputFile, token);
-            token = strtok(NULL, " \n");
+            } else if (*p == '\\') {
+                if (p + 1 < end) {
+                    if (GLOB_CHAR(p[1])) {
+                        *out++ = '\\';
+                        l.escaped = 1;
+                    }
+                    *out++ = p[1];
+                }
+                p += 2;
+                l.quoted = 1;
 
-        // This is the case for output files. Copy the token name to be the output file.
-        } else if (strcmp(token, ">") == 0) {
-            token = strtok(NULL, " \n");
-            strcpy(outputFile, token);
-            token = strtok(NULL, " \n");
+            } else if (*p == '$') {
+                l.out = out;
+                const char *next = lexExpand(&l, p, end, l.assignment);
+                out = l.out;
+                if (next == NULL) {
+                    return -1;
+                }
+                if (next == p) {
+                    *out++ = *p++;
+                } else {
+                    p = next;
+                }
 
-        // Add regular arguments to args and increment the args array.
-        } else {
-            args[i] = token;
-            i++;
-            token = strtok(NULL, " \n");
+            } else {
+                // A "]" only makes a pattern after a "[".
+                l.meta |= (*p == '*' || *p == '?' || (*p == ']' && l.bracket));
+                l.bracket |= (*p == '[');
+                *out++ = *p++;
+            }
         }
 
-    // Checking to see if the command is to be executed in the background.
-    if (token == NULL) {
-        if (strcmp(args[i-1], "&") == 0) {
-            *bg  = 0;
-            args[i-1] = NULL;
+        // Most words are plain arguments, which go straight in. Anything else is left to lexFinish().
+        char *word = l.word;
+        if (!l.escaped && !l.split && l.target == NULL && out > word && l.count + 2 <= arena.argsSize &&
+            !(out - word == 1 && (word[0] == '<' || word[0] == '>' || word[0] == '|' || word[0] == '&'))) {
+            *out++ = '\0';
+            int pattern = l.meta && !l.assignment;
+            arena.patterns[l.count] = pattern;
+            l.patterns += pattern;
+            l.assigning &= l.assignment;
+            arena.assignments += (l.assigning && l.stages == 1);
+            l.argv[l.count++] = word;
+            l.out = out;
+            continue;
         }
+
+        l.out = out;
+        if (lexFinish(&l) < 0) {
+            return -1;
+        }
+    }
+
+    if (l.target != NULL) {
+        fprintf(stderr, "smallsh: missing file name after %s\n", l.target == inputFile ? "<" : ">");
+        return -1;
+    }
+
+    // Checking to see if the command is to be executed in the background.
+    if (l.ampersand != NULL && l.count > 0 && l.argv[l.count - 1] == l.ampersand) {
+        *bg = 0;
+        l.count--;
+        l.patterns -= arena.patterns[l.count];
+    }
+
+    // A "|" at the end doesn't start another stage.
+    while (l.stages > 1 && l.argv[l.count - 1] == NULL) {
+        l.count--;
+        l.stages--;
     }
+    l.argv[l.count] = NULL;
+    *args = l.argv;
+    *stages = l.stages;
 
+    // Patterns are expanded once the whole line is split up, so the names can go anywhere.
+    if (l.patterns > 0) {
+        expandGlobs(args, l.count);
     }
+    return 0;
 }
 
 
@@ -371,30 +4162,216 @@ void SIGTSTP_handler(int signo) {
 }
 
 
+/* Runs one command line: splits it up, sets the variables assigned on it, and runs the builtin
+   or the command, with "time" and "limit" in front of it handled. *exitStatus is the status of
+   the last foreground command, which the line updates. */
+void runLine(const char *line, size_t len, int *exitStatus) {
+    char **args;
+    char *inputFile, *outputFile;
+
+    // Background flag.
+    int bg = 1;
+
+    // Number of commands in a pipeline.
+    int stages = 1;
+
+    // Check for a empty string or a comment on the command line, or a line that can't be split up.
+    lastExitStatus = *exitStatus;
+    substitutionStatus = 0;
+    if (line[0] == ' ' || line[0] == '#' || parseInput(line, len, &args, &stages, &bg, &inputFile, &outputFile) < 0) {
+        return;
+    }
+
+    // A line that's nothing but empty expansions leaves the status as it was.
+    if (args[0] == NULL) {
+        return;
+    }
+
+    // NAME=value on its own sets a variable in the shell. In front of a command it's only
+    // passed on to that command, and put back the way it was after.
+    int assignments = arena.assignments, i;
+    char **assigned = args, *saved[assignments > 0 ? assignments : 1];
+    int savedExported[assignments > 0 ? assignments : 1];
+    for (i = 0; i < assignments; i++) {
+        size_t nameLen = assignmentName(assigned[i]);
+        struct variable *v = (variables.size > 0) ? &variables.slots[variableFind(assigned[i], nameLen)] : NULL;
+        saved[i] = (v != NULL && v->entry != NULL) ? strdup(v->entry) : NULL;
+        savedExported[i] = (v != NULL && v->entry != NULL && v->exported);
+        variableSet(assigned[i], nameLen, args[assignments] != NULL);
+    }
+    if (assignments > 0 && args[assignments] == NULL) {
+        for (i = 0; i < assignments; i++) {
+            free(saved[i]);
+        }
+        *exitStatus = substitutionStatus;
+        return;
+    }
+    args += assignments;
+
+    // "time" in front of a command reports what it used once it's done.
+    int timed = (args[0] != NULL && strcmp(args[0], "time") == 0), spawned = 0;
+    pid_t background = lastBackground;
+    struct usage used = { nowNS() };
+    struct rusage before, after;
+    if (timed) {
+        args++;
+        getrusage(RUSAGE_SELF, &before);
+    }
+
+    // "limit" in front of a command starts its processes with the limits given.
+    struct limits limits;
+    int limited = (args[0] != NULL && strcmp(args[0], "limit") == 0), skip = 0;
+    if (limited) {
+        skip = limitArgs(args, &limits);
+        args += (skip > 0) ? skip : 0;
+    }
+
+    // Builtins are found by their whole name, and run in the shell when they can. A limited
+    // one runs as the program it stands in for, the ones working on the shell can't be limited.
+    struct builtin *b = (args[0] != NULL && stages == 1) ? findBuiltin(args[0]) : NULL;
+    if (skip < 0 || (limited && b != NULL && b->special)) {
+        if (skip >= 0) {
+            fprintf(stderr, "limit: %s is a shell builtin\n", args[0]);
+        }
+        *exitStatus = W_EXITCODE(1, 0);
+    } else if (b != NULL && !limited && (b->special || bg == 1 || bgIgnore == 0)) {
+        runBuiltin(b, args, inputFile, outputFile, exitStatus);
+
+    // Execute the command or tries to and updates the exit status.
+    } else if (args[0] != NULL) {
+        // A foreground pipeline can end in a builtin that reads its stdin, like "find | xargs".
+        struct builtin *tail = NULL;
+        if (stages > 1 && !limited && (bg == 1 || bgIgnore == 0)) {
+            char **last = args;
+            int stage;
+            for (stage = 1; stage < stages; stage++) {
+                while (*last != NULL) {
+                    last++;
+                }
+                last++;
+            }
+            tail = (last[0] != NULL) ? findBuiltin(last[0]) : NULL;
+            if (tail != NULL && !tail->pipeTail) {
+                tail = NULL;
+            }
+        }
+        exeCMD(args, stages, bg, inputFile, outputFile, limited ? &limits : NULL, tail, exitStatus);
+        spawned = 1;
+    }
+
+    // A background job is reported when it's done, a builtin by what the shell itself used.
+    if (timed && lastBackground != background) {
+        int j = jobFind(lastBackground);
+        if (j >= 0) {
+            jobs.slots[j].timed = 1;
+        }
+    } else if (timed && spawned) {
+        printUsage(&lastUsage);
+    } else if (timed) {
+        getrusage(RUSAGE_SELF, &after);
+        struct usage self = { 0 };
+        usageAdd(&self, &after);
+        self.userUS -= before.ru_utime.tv_sec * 1000000LL + before.ru_utime.tv_usec;
+        self.sysUS -= before.ru_stime.tv_sec * 1000000LL + before.ru_stime.tv_usec;
+        self.voluntary -= before.ru_nvcsw;
+        self.involuntary -= before.ru_nivcsw;
+        self.wallNS = nowNS() - used.startNS;
+        printUsage(&self);
+    }
+
+    for (i = assignments - 1; i >= 0; i--) {
+        variableRestore(assigned[i], assignmentName(assigned[i]), saved[i], savedExported[i]);
+    }
+}
+
+
+/* Runs the command of a "$(...)" in the copy of the shell lexSubstitute() made with fork(), the
+   same way "smallsh -c" runs a command, and exits with its status. It never returns to the line
+   the other shell was splitting up. What the copy shouldn't share with that shell is put right
+   first: the jobs are that shell's, and SIGCHLD gets a signalfd of its own. The trace file was
+   flushed before the fork, and it's opened for appending and line buffered, so both shells add
+   whole lines to it and the commands run here are traced too. */
+void runSubshell(const char *text, size_t len) {
+    // Captured output so far can still be shown with "jobs -o", but only the other shell reads
+    // the pipes. A job's cgroup is only freed, the other shell removes it.
+    int i;
+    for (i = 0; i < captures.count; i++) {
+        if (captures.list[i]->fd >= 0) {
+            close(captures.list[i]->fd);
+            captures.list[i]->fd = -1;
+        }
+    }
+    captures.open = 0;
+    for (i = 0; i < jobs.size; i++) {
+        if (jobs.slots[i].pid > 0) {
+            free(jobs.slots[i].command);
+            free(jobs.slots[i].cgroup);
+        }
+    }
+    free(jobs.slots);
+    jobs = (struct jobTable) { NULL, 0, 0, 0, 1 };
 
-int main() {
-    // Max chars in a command line.
-    const int maxChars = 2048;
-    // Max arguments in a command line.
-    const int maxArg = 512;
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    close(childFD);
+    childFD = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (childFD < 0) {
+        perror("signalfd()");
+        _exit(1);
+    }
 
-    // Count used to keep track of the idx within the pidArray.
-    int count = 0;
-    // pidArray holds child processes of the forked() processes.
-    int pidArray[1000];
+    // A line starting with a blank would be skipped.
+    while (len > 0 && (*text == ' ' || *text == '\t' || *text == '\n')) {
+        text++;
+        len--;
+    }
+    script = text;
+    scriptLen = len;
+    scriptPos = 0;
 
-    // Give each index the value 0 because pid won't have a negative value.
-    int j;
-    for (j = 0; j < 1000; j++) {
-        pidArray[j] = -1;
+    int exitStatus = lastExitStatus;
+    const char *line;
+    ssize_t lineLen;
+    while ((lineLen = readScriptLine(&line)) >= 0) {
+        runLine(line, lineLen, &exitStatus);
     }
+    exitCMD(NULL, exitStatus);
+}
 
 
+int main(int argc, char *argv[]) {
+    // The line read from stdin, grown to fit the longest one so far.
+    char *lineBuffer = NULL;
+    size_t lineSize = 0;
+
     // Starting exit status of processes.
     int exitStatus = 0;
 
-    // Background flag.
-    int bg = 1;
+    // "-c command" runs the command string, any other argument is a script file to run.
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        script = argv[2];
+        scriptLen = strlen(script);
+    } else if (argc == 2 && strcmp(argv[1], "-c") != 0) {
+        loadScript(argv[1]);
+    } else if (argc != 1) {
+        fprintf(stderr, "USAGE: %s [script | -c command]\n", argv[0]);
+        exit(1);
+    }
+
+
+    variablesInit();
+
+    // Commands are added to the trace file as they start and finish.
+    const char *tracePath = variableGet("SMALLSH_TRACE", 13);
+    if (tracePath != NULL && tracePath[0] != '\0') {
+        trace = fopen(tracePath, "ae");
+        if (trace == NULL) {
+            perror(tracePath);
+        } else {
+            setvbuf(trace, NULL, _IOLBF, 0);
+        }
+    }
 
 
     /* Create custom sigaction structs and handlers*/
@@ -412,58 +4389,39 @@ int main() {
 	SIGTSTP_action.sa_flags = SA_RESTART;
 	sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+    // SIGCHLD is blocked and read from a signalfd instead, so it can be waited on together with stdin.
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, NULL);
+    childFD = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (childFD < 0) {
+        perror("signalfd()");
+        exit(1);
+    }
 
 
-    while(1) {
-        char buffer[maxChars];
-        char *args[maxArg];
-
-        // Set the input and output file to be a string called "standard". 
-        char inputFile[2048] = "standard";
-        char outputFile[2048] = "standard";
-
-        // Sets the index's to NULL to stop bugs down the line.
-        int i;
-        for (i = 0; i < maxArg; i++) {
-            args[i] = '\0';
-        }
 
-        printf(": ");
-        fflush(stdout);
-        fgets(buffer, maxChars+1, stdin);
+    while(1) {
+        const char *line;
+        ssize_t len;
 
-        // Check for a empty string or a comment on the command line.
-        if (strncmp(buffer, " ", 1) == 0 || strncmp(buffer, "#", 1) == 0) {
-            continue;
-        
+        // Scripts run without a prompt, and without a flush for every line.
+        if (script != NULL) {
+            len = readScriptLine(&line);
         } else {
-            
-            // Checks for expansion of "$$".
-            expandInput(buffer);
-
-            // Exits the program and terminates the processes.
-            if (strncmp(buffer, "exit", 4) == 0) {
-                exitCMD(pidArray);
-
-            // Shows the status of the last foreground process ran.
-            } else if (strncmp(buffer, "status", 6) == 0) {
-                status(exitStatus);
-
-            // Enters the environment change function.
-            } else if (strncmp(buffer, "cd", 2) == 0) {
-                cd(buffer);
-
-            } else {
-                // Break the command line into arguments.
-                parseInput(buffer, args, &bg, inputFile, outputFile);
-                
-                // Execute the command or tries to and updates the exit status.
-                exeCMD(args, bg, inputFile, outputFile, SIGINT_action, SIGTSTP_action, &exitStatus, pidArray, &count);
+            printf(": ");
+            fflush(stdout);
+            len = readLine(&lineBuffer, &lineSize);
+            line = lineBuffer;
+        }
 
-                // Reset background flag.
-                bg = 1;
-            }
+        // The end of the input works the same as the exit command.
+        if (len < 0) {
+            exitCMD(NULL, exitStatus);
         }
+
+        runLine(line, len, &exitStatus);
     }
 
     return 0;
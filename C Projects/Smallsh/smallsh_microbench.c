@@ -0,0 +1,286 @@
+/* smallsh_microbench times the shell's command line handling on its own, without running anything:
+   parseInput() splitting lines from 16 chars up to -m chars (1 MB by default) into arguments. The
+   shell is compiled in with its main() renamed, so the routine timed is the one in smallsh.c.
+   A plain char at a time splitter for the same subset of the syntax is timed as the reference,
+   and parseInput()'s arguments and file names are checked against it on every line.
+
+   Results go to stdout as a table, and with -o to a CSV file in the same format as otp_microbench
+   (routine, variant, bytes, runs, ns per byte, GB/s, matches). */
+#define main smallsh_main
+#include "smallsh.c"
+#undef main
+
+#include <time.h>
+
+
+// Line sizes start here and double each step.
+#define MIN_SIZE 16
+#define SIZE_STEP 2
+
+
+/* Current time in nanoseconds. */
+long long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/* Builds a command line of size chars, ending in a newline like readLine() leaves it: short
+   words, some quoted, with a "$$" now and then and a pair of redirections near the start. */
+void build_line(char line[], int size) {
+    const char *start = "cmd < in > out";
+    const char *words[] = { "arg", "$$", "file.txt", "-v", "x$$y", "'a b'", "\"x $$\"", "a\\ b" };
+    int count = sizeof(words) / sizeof(words[0]);
+    int len = 0, w = 0;
+
+    strcpy(line, start);
+    len = strlen(start);
+    while (len < size - 1) {
+        const char *word = words[w++ % count];
+        // A quoted word that doesn't fit is left out, so the line never ends inside quotes.
+        if (len + 1 + (int) strlen(word) > size - 1 && strpbrk(word, "'\"\\") != NULL) {
+            word = "x";
+        }
+        line[len++] = ' ';
+        for (int i = 0; word[i] != '\0' && len < size - 1; i++) {
+            line[len++] = word[i];
+        }
+    }
+    line[size - 1] = '\n';
+    line[size] = '\0';
+}
+
+
+/* What a line was split into. */
+struct parsed {
+    char **args;
+    int count;
+    char *input_file, *output_file;
+};
+
+// The reference splitter's words and arguments, as large as the largest line needs.
+char *reference_words;
+char **reference_args;
+
+
+/* The reference: splits a line a char at a time, handling the words build_line() makes: blanks,
+   '...', "..." with \ escapes and "$$" in it, \ outside quotes, "$$" and "<" and ">". */
+void reference_parse(const char line[], int size, struct parsed *result) {
+    char pid[16];
+    int pid_len = sprintf(pid, "%d", getpid());
+    char *out = reference_words, **target = NULL;
+    int i = 0, count = 0;
+    result->input_file = result->output_file = NULL;
+
+    while (1) {
+        while (i < size && (line[i] == ' ' || line[i] == '\t' || line[i] == '\n')) {
+            i++;
+        }
+        if (i >= size) {
+            break;
+        }
+        char *word = out;
+        int quoted = 0;
+        while (i < size && line[i] != ' ' && line[i] != '\t' && line[i] != '\n') {
+            if (line[i] == '\'') {
+                for (i++; line[i] != '\''; i++) {
+                    *out++ = line[i];
+                }
+                i++;
+                quoted = 1;
+            } else if (line[i] == '"') {
+                for (i++; line[i] != '"'; i++) {
+                    if (line[i] == '\\' && (line[i + 1] == '"' || line[i + 1] == '\\' || line[i + 1] == '$')) {
+                        *out++ = line[++i];
+                    } else if (line[i] == '$' && line[i + 1] == '$') {
+                        memcpy(out, pid, pid_len);
+                        out += pid_len;
+                        i++;
+                    } else {
+                        *out++ = line[i];
+                    }
+                }
+                i++;
+                quoted = 1;
+            } else if (line[i] == '\\') {
+                *out++ = line[i + 1];
+                i += 2;
+                quoted = 1;
+            } else if (line[i] == '$' && i + 1 < size && line[i + 1] == '$') {
+                memcpy(out, pid, pid_len);
+                out += pid_len;
+                i += 2;
+            } else {
+                *out++ = line[i++];
+            }
+        }
+        *out++ = '\0';
+
+        if (target != NULL) {
+            *target = word;
+            target = NULL;
+        } else if (!quoted && strcmp(word, "<") == 0) {
+            target = &result->input_file;
+        } else if (!quoted && strcmp(word, ">") == 0) {
+            target = &result->output_file;
+        } else {
+            reference_args[count++] = word;
+        }
+    }
+    reference_args[count] = NULL;
+    result->args = reference_args;
+    result->count = count;
+}
+
+
+/* Splits a line with the shell's parseInput(). */
+void lexer_parse(const char line[], int size, struct parsed *result) {
+    int bg = 1, stages = 1;
+    parseInput(line, size, &result->args, &stages, &bg, &result->input_file, &result->output_file);
+    for (result->count = 0; result->args[result->count] != NULL; result->count++);
+}
+
+
+/* One version of the splitter, the first one is the reference. */
+struct routine {
+    const char *name, *variant;
+    void (*parse)(const char[], int, struct parsed*);
+};
+
+struct routine routines[] = {
+    { "parseInput", "naive", reference_parse },
+    { "parseInput", "lexer", lexer_parse },
+};
+
+
+/* 1 if two splits of a line came out the same. */
+int same_result(const struct parsed *a, const struct parsed *b) {
+    if (a->count != b->count || (a->input_file == NULL) != (b->input_file == NULL) ||
+        (a->output_file == NULL) != (b->output_file == NULL) ||
+        (a->input_file != NULL && strcmp(a->input_file, b->input_file) != 0) ||
+        (a->output_file != NULL && strcmp(a->output_file, b->output_file) != 0)) {
+        return 0;
+    }
+    for (int i = 0; i < a->count; i++) {
+        if (strcmp(a->args[i], b->args[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* Times a splitter on a line. The number of runs doubles until a batch takes at least min_ns.
+   Returns nanoseconds per run. */
+double time_routine(const struct routine *r, const char line[], int size, long long min_ns, long *runs) {
+    struct parsed result;
+    long long elapsed;
+
+    *runs = 1;
+    while (1) {
+        long long start = now_ns();
+        for (long i = 0; i < *runs; i++) {
+            r->parse(line, size, &result);
+        }
+        elapsed = now_ns() - start;
+        if (elapsed >= min_ns) {
+            break;
+        }
+        *runs *= 2;
+    }
+    return (double) elapsed / *runs;
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *usage = "USAGE: %s [-m max_size] [-t min_seconds] [-o results.csv]\n";
+    int max_size = 1 << 20;
+    double min_seconds = 0.1;
+    const char *results_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:o:")) != -1) {
+        switch (opt) {
+        case 'm':
+            max_size = atoi(optarg);
+            break;
+        case 't':
+            min_seconds = atof(optarg);
+            break;
+        case 'o':
+            results_path = optarg;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(1);
+        }
+    }
+    if (max_size < MIN_SIZE) {
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+
+    FILE *results = NULL;
+    if (results_path != NULL) {
+        results = fopen(results_path, "w");
+        if (results == NULL) {
+            fprintf(stderr, "MICROBENCH: ERROR opening %s\n", results_path);
+            exit(1);
+        }
+        fprintf(results, "routine,variant,bytes,runs,ns_per_byte,gb_per_s,matches\n");
+    }
+
+    printf("%-12s %-8s %8s %10s %9s %8s\n", "routine", "variant", "bytes", "ns/byte", "GB/s", "matches");
+    char *line = malloc(max_size + 1);
+    // Every char can grow into the pid, and every other one can be a word of its own.
+    reference_words = malloc((size_t) max_size * 16 + 16);
+    reference_args = malloc((max_size / 2 + 2) * sizeof(char*));
+    if (line == NULL || reference_words == NULL || reference_args == NULL) {
+        fprintf(stderr, "MICROBENCH: ERROR allocating the line, try a smaller -m\n");
+        exit(1);
+    }
+
+    int count = sizeof(routines) / sizeof(routines[0]), mismatches = 0;
+    for (int size = MIN_SIZE; size <= max_size; size *= SIZE_STEP) {
+        build_line(line, size);
+
+        // The reference's split stays in its own buffers while the others are checked against it.
+        struct parsed expected;
+        routines[0].parse(line, size, &expected);
+
+        for (int i = 0; i < count; i++) {
+            const char *matches = "-";
+            if (i > 0) {
+                struct parsed got;
+                routines[i].parse(line, size, &got);
+                int same = same_result(&expected, &got);
+                matches = same ? "yes" : "NO";
+                mismatches += !same;
+            }
+
+            long runs;
+            double ns = time_routine(&routines[i], line, size, (long long) (min_seconds * 1e9), &runs);
+            double ns_per_byte = ns / size, gb_per_s = size / ns;
+
+            printf("%-12s %-8s %8d %10.4f %9.3f %8s\n", routines[i].name, routines[i].variant, size, ns_per_byte, gb_per_s, matches);
+            if (results != NULL) {
+                fprintf(results, "%s,%s,%d,%ld,%.6f,%.6f,%s\n", routines[i].name, routines[i].variant, size, runs,
+                        ns_per_byte, gb_per_s, matches);
+            }
+        }
+    }
+
+    free(line);
+    free(reference_words);
+    free(reference_args);
+    if (results != NULL) {
+        fclose(results);
+    }
+
+    if (mismatches > 0) {
+        fprintf(stderr, "MICROBENCH: %d result(s) didn't match the reference\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file